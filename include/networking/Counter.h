@@ -0,0 +1,29 @@
+#ifndef COUNTER_H
+#define COUNTER_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * @brief
+ * Statistics counter written by one thread and read by any. Updates are a
+ * relaxed load and store instead of a read-modify-write, which is all a
+ * single writer needs and keeps reads from other threads free of tearing.
+ */
+struct Counter {
+    std::atomic<uint64_t> value{0};
+
+    void add(uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void set(uint64_t n) {
+        value.store(n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+        return value.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
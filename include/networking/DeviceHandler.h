@@ -4,51 +4,100 @@
 #include <netlink/NetlinkWrapper.h>
 #include <base/SocketWrapper.h>
 #include <unix_wrapper/UnixWrapper.h>
-#include <iomanip>
 
+#include <poll.h>
+#include <thread>
+#include <unordered_map>
 #include <linux/if_link.h>
 
+#include "LinkEvent.h"
+#include "LinkMessage.h"
+
 using cpp_socket::netlink::NetlinkWrapper;
 using cpp_socket::netlink::LINK;
 using cpp_socket::netlink::ROUTE;
 using cpp_socket::unix_wrapper::UnixWrapper;
 
-
-std::string macToString(const unsigned char* mac_bytes, size_t length = 6) {
-    std::ostringstream oss;
-    for (size_t i = 0; i < length; ++i) {
-        if (i != 0)
-            oss << ":";
-        oss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(mac_bytes[i]);
-    }
-    return oss.str();
-}
-
+/**
+ * @brief
+ * Forwards rtnetlink link notifications to the forwarder. Events for the
+ * same link that arrive within the coalescing window collapse into the
+ * latest one, so a flapping link costs the forwarder one port update
+ * instead of one per transition. When the kernel overruns the netlink
+ * socket the lost notifications are replaced by a full link dump.
+ */
 class DeviceHandler {
     public:
-    DeviceHandler(std::string address, std::string packet_handler_address) {
+    /**
+     * @brief
+     *
+     * @param address
+     * @param packet_handler_address
+     * @param coalesce_window_ms how long the first pending event waits for later ones
+     */
+    DeviceHandler(std::string address, std::string packet_handler_address, unsigned int coalesce_window_ms = 5) {
         netlinkWrapper = new NetlinkWrapper(ROUTE, LINK, true);
         unixWrapper = new UnixWrapper(address, true, true);
         this->packet_handler_address = UnixWrapper::get_dest_sockaddr(packet_handler_address, true);
+        coalesce_window_ns = (uint64_t)coalesce_window_ms * 1'000'000;
+
+        // a burst of link changes at boot easily overruns the default buffer
+        int fd = netlinkWrapper->get_socket();
+        int rcvbuf = 1 << 20;
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
     }
 
     void run() {
+        int fd = netlinkWrapper->get_socket();
         while (true) {
-            std::vector<char> buf(1 << 17); // 128 KiB
-            int n = netlinkWrapper->receive_wrapper(buf.data(), buf.size(), 0);
+            // with events pending wait at most until their window closes
+            int timeout_ms = -1;
+            if (!pending.empty()) {
+                uint64_t now_ns = now_ns_monotonic();
+                uint64_t deadline_ns = pending_since_ns + coalesce_window_ns;
+                if (now_ns >= deadline_ns) {
+                    flush_pending();
+                    continue;
+                }
+                timeout_ms = (deadline_ns - now_ns + 999'999) / 1'000'000;
+            }
+
+            pollfd pfd{fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, timeout_ms);
+            if (ready < 0) {
+                if (errno != EINTR) {
+                    perror("Error waiting for netlink");
+                }
+                continue;
+            }
+            if (ready == 0) {
+                flush_pending();
+                continue;
+            }
+
+            int n = netlinkWrapper->receive_wrapper(buffer.data(), buffer.size(), MSG_DONTWAIT);
     
             if (n < 0) {
-                if (errno == EINTR) {
-                    continue; // since blocking call may get interrupted via kernel mid read
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    continue;
+                }
+                if (errno == ENOBUFS) {
+                    // the kernel dropped notifications, replace them with the current state
+                    std::cerr << "Netlink overran, resyncing links" << std::endl;
+                    resync();
+                    continue;
                 }
     
                 perror("Error receiving from netlink");
-
-                break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
             }
+            uint64_t received_ns = now_ns_monotonic();
     
             // Walk all netlink messages in this datagram
-            for (nlmsghdr* nh = (nlmsghdr*)buf.data(); NLMSG_OK(nh, (unsigned)n); nh = NLMSG_NEXT(nh, n)) {
+            for (nlmsghdr* nh = (nlmsghdr*)buffer.data(); NLMSG_OK(nh, (unsigned)n); nh = NLMSG_NEXT(nh, n)) {
                 if (nh->nlmsg_type == NLMSG_ERROR) {
                     std::cerr << "netlink: NLMSG_ERROR" << std::endl;
                     continue;
@@ -56,101 +105,146 @@ class DeviceHandler {
                 if (nh->nlmsg_type == NLMSG_DONE) {
                     continue;
                 }
-                if (nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK) {
+
+                LinkEvent event{};
+                if (!parse_link_message(nh, event)) {
                     // Not a link event; ignore (you can subscribe to more groups and handle here)
                     continue;
                 }
-    
-                // Header -> ifinfomsg
-                auto* ifi = (ifinfomsg*)NLMSG_DATA(nh);
-                int ifindex = ifi->ifi_index;
-                unsigned ifflags = ifi->ifi_flags;
-    
-                // Parse attributes
-                char ifname[IF_NAMESIZE] = {0};
-                unsigned char* mac_bytes = nullptr;
-                int maclen = 0;
-                int mtu = 0;
-    
-                int attrlen = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
-                for (rtattr* rta = (rtattr*)IFLA_RTA(ifi); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
-                    switch (rta->rta_type) {
-                        case IFLA_IFNAME:
-                            std::snprintf(ifname, sizeof(ifname), "%s", (char*)RTA_DATA(rta));
-                            break;
-                        case IFLA_ADDRESS:
-                            mac_bytes = (unsigned char*)RTA_DATA(rta);
-                            maclen = RTA_PAYLOAD(rta);
-                            break;
-                        case IFLA_MTU:
-                            mtu = *(int*)RTA_DATA(rta);
-                            break;
-                        default:
-                            break;
-                    }
-                }
-
-                std::string ifname_str(ifname);
-
-
-                if (nh->nlmsg_type == RTM_NEWLINK) {
-                    // ifname NEW <LOOPBACK,BROADCAST,MULTICAST,LOWER_UP> <mtu> <mac>
+                event.received_ns = received_ns;
+                received++;
+                queue_event(event);
+            }
+        }
+    }
 
-                    ifname_str += " NEW";
+    void print_stats() {
+        std::cerr << "link events received " << received << " coalesced " << coalesced
+            << " sent " << sent << " resyncs " << resyncs << std::endl;
+    }
 
-                    bool loopback = (ifi->ifi_flags & IFF_LOOPBACK) != 0;
-                    bool broadcast = (ifi->ifi_flags & IFF_BROADCAST) != 0;
-                    bool multicast = (ifi->ifi_flags & IFF_MULTICAST) != 0;
-                    bool lower_up = (ifi->ifi_flags & (1 << 16)) != 0; // IF_LOWER_UP 1 << 16
+    ~DeviceHandler() {
+        delete netlinkWrapper;
+        delete unixWrapper;
+        delete packet_handler_address;
+    }
 
-                    ifname_str += " <";
+    // link events read from netlink, dropped in favour of a later one for the same link, sent and full resyncs
+    uint64_t received = 0;
+    uint64_t coalesced = 0;
+    uint64_t sent = 0;
+    uint64_t resyncs = 0;
 
-                    std::string ifflags_str = "";
+    private:
+    /**
+     * @brief
+     * Adds event to the pending events, replacing a pending event of the
+     * same link in place
+     *
+     * @param event
+     */
+    void queue_event(LinkEvent& event) {
+        auto it = pending_index.find(event.ifindex);
+        if (it != pending_index.end() && std::strncmp(pending[it->second].ifname, event.ifname, sizeof(event.ifname)) == 0) {
+            // latency is counted from the first change
+            event.received_ns = pending[it->second].received_ns;
+            pending[it->second] = event;
+            coalesced++;
+            return;
+        }
 
-                    if (loopback) {
-                        ifflags_str += "LOOPBACK,";
-                    }
+        if (pending.empty()) {
+            pending_since_ns = event.received_ns;
+        }
+        pending_index[event.ifindex] = pending.size();
+        pending.push_back(event);
 
-                    if (broadcast) {
-                        ifflags_str += "BROADCAST,";
-                    }
+        if (pending.size() >= LINK_EVENT_BATCH_MAX) {
+            flush_pending();
+        }
+    }
 
-                    if (multicast) {
-                        ifflags_str += "MULTICAST,";
-                    }
+    /**
+     * @brief sends the pending events to the forwarder
+     */
+    void flush_pending() {
+        for (auto& event: pending) {
+            add_event(event);
+        }
+        send_batch();
+        pending.clear();
+        pending_index.clear();
 
-                    if (lower_up) {
-                        ifflags_str += "LOWER_UP,";
-                    }
+        #ifndef NDEBUG
+        print_stats();
+        #endif
+    }
 
-                    if (ifflags_str != "") {
-                        ifflags_str.pop_back();
-                    }
+    /**
+     * @brief
+     * Sends the pending events followed by the complete list of links, marked
+     * so the forwarder drops ports whose link is not in it
+     */
+    void resync() {
+        flush_pending();
+
+        std::vector<LinkEvent> links;
+        if (!dump_links(links)) {
+            std::cerr << "Link resync failed, keeping the forwarder's ports" << std::endl;
+            return;
+        }
+        resyncs++;
+
+        LinkEvent marker{};
+        marker.received_ns = now_ns_monotonic();
+        marker.type = static_cast<uint8_t>(LinkEventType::SYNC_BEGIN);
+        add_event(marker);
+        for (auto& link: links) {
+            add_event(link);
+        }
+        marker.type = static_cast<uint8_t>(LinkEventType::SYNC_END);
+        add_event(marker);
+        send_batch();
 
-                    ifname_str += ifflags_str + ">";
+        print_stats();
+    }
 
-                    ifname_str += " " + std::to_string(mtu);
-                    ifname_str += " "  + macToString(mac_bytes, maclen);
-                }
-                else if (nh->nlmsg_type == RTM_DELLINK) {
-                    //ifname DEL 
-                    ifname_str += " DEL";
-                }
-                unixWrapper->sendto_wrapper(ifname_str.c_str(), ifname_str.size(), 0, packet_handler_address->get_sockaddr(), packet_handler_address->size());
-            }
+    void add_event(const LinkEvent& event) {
+        if (batch.full()) {
+            send_batch();
         }
+        batch.add(event);
     }
 
-    ~DeviceHandler() {
-        delete netlinkWrapper;
-        delete unixWrapper;
-        delete packet_handler_address;
+    /**
+     * @brief sends the events collected in batch to the forwarder as one datagram and empties it
+     */
+    void send_batch() {
+        if (batch.header.count == 0) {
+            return;
+        }
+        if (unixWrapper->sendto_wrapper((char*)&batch, batch.size(), 0, packet_handler_address->get_sockaddr(), packet_handler_address->size()) < 0) {
+            perror("Error sending link events to the forwarder");
+        }
+        else {
+            sent += batch.header.count;
+        }
+        batch.clear();
     }
 
-    private:
     NetlinkWrapper* netlinkWrapper;
     UnixWrapper* unixWrapper;
     Address* packet_handler_address;
+
+    // reused for every netlink datagram
+    std::vector<char> buffer = std::vector<char>(1 << 17); // 128 KiB
+    LinkEventBatch batch;
+
+    // events waiting for the coalescing window, in arrival order, and their index by ifindex
+    std::vector<LinkEvent> pending;
+    std::unordered_map<uint32_t, size_t> pending_index;
+    uint64_t pending_since_ns = 0;
+    uint64_t coalesce_window_ns;
 };
 
-#endif
\ No newline at end of file
+#endif
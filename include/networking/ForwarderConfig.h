@@ -0,0 +1,393 @@
+#ifndef FORWARDER_CONFIG_H
+#define FORWARDER_CONFIG_H
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <string_utils.h>
+
+#include <networking/linklayer/PacketRing.h>
+#include <networking/PacketQueue.h>
+#include <networking/linklayer/mac_utils.h>
+#include <networking/linklayer/Acl.h>
+
+using cpp_utils::string_utils::convert_string;
+
+enum class RxMode {
+    RECV,  // one recv() per frame
+    RING,  // TPACKET_V3 mmap rx ring
+    BATCH, // recvmmsg() over batch_size frames
+    URING, // multishot recvmsg() on the worker's io_uring, every socket with io_engine io_uring
+    XDP    // AF_XDP rx ring of the worker's queue, sockets of ports with xdp on or generic
+};
+
+enum class TxMode {
+    SEND,  // one send() per frame from the output buffer
+    RING,  // TPACKET_V3 mmap tx ring, one send() per batch
+    BATCH, // sendmmsg() over batch_size frames from the output buffer
+    URING, // sends from the output buffer submitted on the worker's io_uring, every socket with io_engine io_uring
+    XDP    // AF_XDP tx ring, one sendto() per batch, frames received on AF_XDP go without a copy
+};
+
+enum class IoEngine {
+    EPOLL,   // epoll_wait() and a syscall per receive and transmit, as the port's rx_mode and tx_mode say
+    IO_URING // every worker sleeps, receives and transmits on its own io_uring, rx_mode and tx_mode are ignored
+};
+
+enum class XdpMode {
+    OFF,    // packet sockets only
+    ON,     // AF_XDP sockets, native mode and zero-copy where the driver has them
+    GENERIC // AF_XDP sockets with the program in generic (SKB) mode, works on any interface
+};
+
+enum class FanoutMode {
+    HASH, // by flow hash, keeps every flow on one worker
+    CPU   // by the cpu the frame arrived on
+};
+
+enum class LinkMonitor {
+    DEVICE_MANAGER, // link events come from the device_manager process over the unix socket
+    NETLINK         // the first worker reads rtnetlink link notifications between its batches
+};
+
+enum class PollMode {
+    BLOCK,   // workers sleep in epoll_wait() until a socket is ready
+    BUSY,    // workers never sleep, they poll their sockets and let the kernel busy poll the device queues
+    ADAPTIVE // like BUSY for poll_budget_us after the last event, then BLOCK until the next one
+};
+
+struct PortConfig {
+    RxMode rx_mode = RxMode::RECV;
+    TxMode tx_mode = TxMode::SEND;
+    XdpMode xdp = XdpMode::OFF;
+    // dropped by the port's socket filter, port lines add to the defaults
+    std::vector<uint64_t> blocked_macs;
+    std::vector<uint16_t> blocked_ethertypes;
+};
+
+/**
+ * @brief
+ * Forwarder settings read from a plain text file, one option per line:
+ *
+ *     # defaults for every port
+ *     rx_mode ring
+ *     tx_mode ring
+ *     ring_block_size 65536
+ *     # per port override
+ *     port eth0 rx_mode recv
+ *     port eth1 xdp on
+ *     # ingress acl, first match wins
+ *     acl eth0 deny ethertype 0x86dd
+ *
+ * Port lines override the defaults regardless of where they appear.
+ * The forwarder reloads the file on SIGHUP.
+ */
+class ForwarderConfig {
+    public:
+    ForwarderConfig() {
+    }
+
+    /**
+     * @brief
+     * Throws std::invalid_argument on unreadable files or bad options
+     *
+     * @param path
+     */
+    ForwarderConfig(std::string path) {
+        this->path = path;
+        std::ifstream file(path);
+
+        if (!file.is_open()) {
+            throw std::invalid_argument("Unable to open config file " + path);
+        }
+
+        std::vector<std::vector<std::string>> port_lines;
+        std::string line;
+        int line_number = 0;
+
+        while (std::getline(file, line)) {
+            line_number++;
+            line = line.substr(0, line.find('#'));
+
+            std::istringstream iss(line);
+            std::vector<std::string> tokens;
+            std::string token;
+            while (iss >> token) {
+                tokens.push_back(token);
+            }
+
+            if (tokens.empty()) {
+                continue;
+            }
+
+            std::string where = path + ":" + std::to_string(line_number) + ": ";
+
+            try {
+                if (tokens[0] == "port") {
+                    if (tokens.size() != 4) {
+                        throw std::invalid_argument("expected port <ifname> <option> <value>");
+                    }
+                    // validate now, apply once the defaults are final
+                    PortConfig scratch;
+                    set_port_option(scratch, tokens[2], tokens[3]);
+                    port_lines.push_back(tokens);
+                }
+                else if (tokens[0] == "acl") {
+                    acl_rules.push_back(AclRule::parse(tokens));
+                }
+                else if (tokens.size() != 2) {
+                    throw std::invalid_argument("expected <option> <value>");
+                }
+                else {
+                    set_option(tokens[0], tokens[1]);
+                }
+            } catch (std::invalid_argument& e) {
+                throw std::invalid_argument(where + e.what());
+            }
+        }
+
+        for (auto& tokens: port_lines) {
+            if (!ports.contains(tokens[1])) {
+                ports.insert({tokens[1], defaults});
+            }
+            set_port_option(ports.at(tokens[1]), tokens[2], tokens[3]);
+        }
+    }
+
+    const PortConfig& port(const std::string& ifname) const {
+        auto it = ports.find(ifname);
+        if (it == ports.end()) {
+            return defaults;
+        }
+        return it->second;
+    }
+
+    std::string path; // empty when running on defaults
+    PortConfig defaults;
+    std::unordered_map<std::string, PortConfig> ports;
+    RingConfig ring;
+    unsigned int batch_size = 32;
+    unsigned int pool_buffers = 4096;
+    unsigned int mac_table_size = 8192;
+    unsigned int mac_aging_timeout = 10; // seconds
+    int pool_frame_size = 0; // 0 sizes pool buffers for the largest port mtu at startup
+    unsigned int stats_interval = 0; // seconds, 0 disables the periodic port stats
+    unsigned int workers = 1; // packet processor threads, each with its own socket per port
+    FanoutMode fanout_mode = FanoutMode::HASH;
+    unsigned int tx_queue_depth = 256; // packets waiting per port and worker
+    DropPolicy tx_queue_policy = DropPolicy::TAIL;
+    LinkMonitor link_monitor = LinkMonitor::DEVICE_MANAGER;
+    std::vector<AclRule> acl_rules; // in file order
+    unsigned int flow_cache_size = 4096; // switching decisions cached per worker, 0 disables the cache
+    IoEngine io_engine = IoEngine::EPOLL;
+    unsigned int uring_buffers = 1024; // receive buffers per worker with io_engine io_uring
+    unsigned int xdp_frames = 4096; // umem chunks per worker, shared by its AF_XDP sockets
+    PollMode poll_mode = PollMode::BLOCK;
+    unsigned int busy_poll_us = 50; // how long the kernel busy polls a device queue per poll, 0 leaves it to the sysctls
+    unsigned int poll_budget_us = 1000; // how long an adaptive worker keeps polling after its last event
+
+    private:
+    void set_option(const std::string& key, const std::string& value) {
+        if (key == "ring_block_size") {
+            ring.block_size = convert_string<unsigned int>(value);
+        }
+        else if (key == "ring_block_count") {
+            ring.block_count = convert_string<unsigned int>(value);
+        }
+        else if (key == "ring_block_timeout_ms") {
+            ring.block_timeout_ms = convert_string<unsigned int>(value);
+        }
+        else if (key == "ring_tx_block_count") {
+            ring.tx_block_count = convert_string<unsigned int>(value);
+        }
+        else if (key == "ring_tx_frame_size") {
+            ring.tx_frame_size = convert_string<unsigned int>(value);
+        }
+        else if (key == "batch_size") {
+            batch_size = convert_string<unsigned int>(value);
+            if (batch_size == 0) {
+                throw std::invalid_argument("batch_size must be positive");
+            }
+        }
+        else if (key == "pool_buffers") {
+            pool_buffers = convert_string<unsigned int>(value);
+        }
+        else if (key == "mac_aging_timeout") {
+            mac_aging_timeout = convert_string<unsigned int>(value);
+            if (mac_aging_timeout == 0) {
+                throw std::invalid_argument("mac_aging_timeout must be positive");
+            }
+        }
+        else if (key == "mac_table_size") {
+            mac_table_size = convert_string<unsigned int>(value);
+        }
+        else if (key == "pool_frame_size") {
+            pool_frame_size = convert_string<int>(value);
+        }
+        else if (key == "stats_interval") {
+            stats_interval = convert_string<unsigned int>(value);
+        }
+        else if (key == "workers") {
+            workers = convert_string<unsigned int>(value);
+            if (workers == 0) {
+                throw std::invalid_argument("workers must be positive");
+            }
+        }
+        else if (key == "fanout_mode") {
+            if (value == "hash") {
+                fanout_mode = FanoutMode::HASH;
+            }
+            else if (value == "cpu") {
+                fanout_mode = FanoutMode::CPU;
+            }
+            else {
+                throw std::invalid_argument("fanout_mode must be hash or cpu");
+            }
+        }
+        else if (key == "tx_queue_depth") {
+            tx_queue_depth = convert_string<unsigned int>(value);
+            if (tx_queue_depth == 0) {
+                throw std::invalid_argument("tx_queue_depth must be positive");
+            }
+        }
+        else if (key == "tx_queue_policy") {
+            if (value == "tail") {
+                tx_queue_policy = DropPolicy::TAIL;
+            }
+            else if (value == "head") {
+                tx_queue_policy = DropPolicy::HEAD;
+            }
+            else {
+                throw std::invalid_argument("tx_queue_policy must be tail or head");
+            }
+        }
+        else if (key == "flow_cache_size") {
+            flow_cache_size = convert_string<unsigned int>(value);
+        }
+        else if (key == "io_engine") {
+            if (value == "epoll") {
+                io_engine = IoEngine::EPOLL;
+            }
+            else if (value == "io_uring") {
+                io_engine = IoEngine::IO_URING;
+            }
+            else {
+                throw std::invalid_argument("io_engine must be epoll or io_uring");
+            }
+        }
+        else if (key == "xdp_frames") {
+            xdp_frames = convert_string<unsigned int>(value);
+            if (xdp_frames == 0) {
+                throw std::invalid_argument("xdp_frames must be positive");
+            }
+        }
+        else if (key == "uring_buffers") {
+            uring_buffers = convert_string<unsigned int>(value);
+            if (uring_buffers == 0) {
+                throw std::invalid_argument("uring_buffers must be positive");
+            }
+        }
+        else if (key == "link_monitor") {
+            if (value == "device_manager") {
+                link_monitor = LinkMonitor::DEVICE_MANAGER;
+            }
+            else if (value == "netlink") {
+                link_monitor = LinkMonitor::NETLINK;
+            }
+            else {
+                throw std::invalid_argument("link_monitor must be device_manager or netlink");
+            }
+        }
+        else if (key == "poll_mode") {
+            if (value == "block") {
+                poll_mode = PollMode::BLOCK;
+            }
+            else if (value == "busy") {
+                poll_mode = PollMode::BUSY;
+            }
+            else if (value == "adaptive") {
+                poll_mode = PollMode::ADAPTIVE;
+            }
+            else {
+                throw std::invalid_argument("poll_mode must be block, busy or adaptive");
+            }
+        }
+        else if (key == "busy_poll_us") {
+            busy_poll_us = convert_string<unsigned int>(value);
+        }
+        else if (key == "poll_budget_us") {
+            poll_budget_us = convert_string<unsigned int>(value);
+        }
+        else {
+            set_port_option(defaults, key, value);
+        }
+    }
+
+    void set_port_option(PortConfig& config, const std::string& key, const std::string& value) {
+        if (key == "rx_mode") {
+            if (value == "recv") {
+                config.rx_mode = RxMode::RECV;
+            }
+            else if (value == "ring") {
+                config.rx_mode = RxMode::RING;
+            }
+            else if (value == "batch") {
+                config.rx_mode = RxMode::BATCH;
+            }
+            else {
+                throw std::invalid_argument("rx_mode must be recv, ring or batch");
+            }
+        }
+        else if (key == "tx_mode") {
+            if (value == "send") {
+                config.tx_mode = TxMode::SEND;
+            }
+            else if (value == "ring") {
+                config.tx_mode = TxMode::RING;
+            }
+            else if (value == "batch") {
+                config.tx_mode = TxMode::BATCH;
+            }
+            else {
+                throw std::invalid_argument("tx_mode must be send, ring or batch");
+            }
+        }
+        else if (key == "xdp") {
+            if (value == "off") {
+                config.xdp = XdpMode::OFF;
+            }
+            else if (value == "on") {
+                config.xdp = XdpMode::ON;
+            }
+            else if (value == "generic") {
+                config.xdp = XdpMode::GENERIC;
+            }
+            else {
+                throw std::invalid_argument("xdp must be off, on or generic");
+            }
+        }
+        else if (key == "block_mac") {
+            config.blocked_macs.push_back(pack_mac_bytes(mac_str_to_bytes(value).data()));
+        }
+        else if (key == "block_ethertype") {
+            unsigned long ethertype;
+            try {
+                ethertype = std::stoul(value, nullptr, 16);
+            } catch (std::exception&) {
+                throw std::invalid_argument("block_ethertype must be hex, e.g. 0x86dd");
+            }
+            if (ethertype > 0xFFFF) {
+                throw std::invalid_argument("block_ethertype must be at most 0xffff");
+            }
+            config.blocked_ethertypes.push_back(ethertype);
+        }
+        else {
+            throw std::invalid_argument("unknown option " + key);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef LINK_EVENT_H
+#define LINK_EVENT_H
+
+#include <cstdint>
+#include <net/if.h>
+
+/**
+ * @brief
+ * Wire format of the link events the device manager sends the forwarder.
+ * One datagram is a LinkEventHeader followed by header.count LinkEvents.
+ * Fields are fixed width in host byte order, both ends run on the same
+ * machine. Bump LINK_EVENT_VERSION on any layout change, receivers drop
+ * datagrams of another version.
+ */
+
+constexpr uint16_t LINK_EVENT_MAGIC = 0x4C45; // "LE"
+constexpr uint8_t LINK_EVENT_VERSION = 3;
+
+// events per datagram, a sender splits larger batches
+constexpr uint16_t LINK_EVENT_BATCH_MAX = 64;
+
+enum class LinkEventType : uint8_t {
+    NEW = 1,        // link added or changed
+    DEL = 2,        // link removed
+    SYNC_BEGIN = 3, // a full list of the links follows, may span datagrams
+    SYNC_END = 4    // end of the list, links missing from it are gone
+};
+
+enum LinkFlags : uint32_t {
+    LINK_LOOPBACK = 1 << 0,
+    LINK_BROADCAST = 1 << 1,
+    LINK_MULTICAST = 1 << 2,
+    LINK_LOWER_UP = 1 << 3
+};
+
+struct LinkEventHeader {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t reserved;
+    uint16_t count;
+    uint16_t reserved2;
+};
+
+struct LinkEvent {
+    uint64_t received_ns; // CLOCK_MONOTONIC when the notification was read from netlink
+    uint32_t ifindex;
+    uint32_t flags; // LinkFlags
+    uint32_t mtu;
+    uint8_t type; // LinkEventType
+    uint8_t reserved;
+    uint8_t mac[6];
+    char ifname[IF_NAMESIZE]; // nul padded, a full length name has no terminator
+    uint32_t reserved2;
+};
+
+static_assert(sizeof(LinkEventHeader) == 8, "LinkEventHeader layout changed");
+static_assert(sizeof(LinkEvent) == 48, "LinkEvent layout changed");
+
+/**
+ * @brief
+ * A batch of link events with room for a full datagram
+ */
+struct LinkEventBatch {
+    LinkEventHeader header{LINK_EVENT_MAGIC, LINK_EVENT_VERSION, 0, 0, 0};
+    LinkEvent events[LINK_EVENT_BATCH_MAX];
+
+    bool full() {
+        return header.count == LINK_EVENT_BATCH_MAX;
+    }
+
+    void clear() {
+        header.count = 0;
+    }
+
+    /**
+     * @brief
+     * Appends event, the caller flushes the batch before it is full
+     *
+     * @param event
+     */
+    void add(const LinkEvent& event) {
+        events[header.count++] = event;
+    }
+
+    /**
+     * @brief bytes to send for the events added so far
+     */
+    size_t size() {
+        return sizeof(LinkEventHeader) + header.count * sizeof(LinkEvent);
+    }
+
+    /**
+     * @brief
+     * Checks a received datagram of length bytes in this batch
+     *
+     * @param length
+     * @return boolean (Returns false if it is not a complete batch of this version)
+     */
+    bool valid(size_t length) {
+        return length >= sizeof(LinkEventHeader)
+            && header.magic == LINK_EVENT_MAGIC
+            && header.version == LINK_EVENT_VERSION
+            && header.count <= LINK_EVENT_BATCH_MAX
+            && length == size();
+    }
+};
+
+#endif
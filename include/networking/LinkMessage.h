@@ -0,0 +1,178 @@
+#ifndef LINK_MESSAGE_H
+#define LINK_MESSAGE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+
+#include "LinkEvent.h"
+#include "linklayer/time_utils.h"
+
+/**
+ * @brief LinkFlags of the kernel's ifi_flags
+ *
+ * @param ifi_flags
+ * @return uint32_t
+ */
+uint32_t link_flags(unsigned int ifi_flags) {
+    uint32_t flags = 0;
+    if (ifi_flags & IFF_LOOPBACK) {
+        flags |= LINK_LOOPBACK;
+    }
+    if (ifi_flags & IFF_BROADCAST) {
+        flags |= LINK_BROADCAST;
+    }
+    if (ifi_flags & IFF_MULTICAST) {
+        flags |= LINK_MULTICAST;
+    }
+    if (ifi_flags & (1 << 16)) { // IFF_LOWER_UP
+        flags |= LINK_LOWER_UP;
+    }
+    return flags;
+}
+
+/**
+ * @brief
+ * Fills event from an RTM_NEWLINK or RTM_DELLINK message, shared by the
+ * device manager's notifications and the forwarder's startup dump
+ *
+ * @param nh
+ * @param event zeroed by the caller
+ * @return boolean (Returns false if nh is not a link message)
+ */
+bool parse_link_message(nlmsghdr* nh, LinkEvent& event) {
+    if (nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK) {
+        return false;
+    }
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(ifinfomsg))) {
+        return false;
+    }
+
+    auto* ifi = (ifinfomsg*)NLMSG_DATA(nh);
+    event.ifindex = ifi->ifi_index;
+    event.type = static_cast<uint8_t>(nh->nlmsg_type == RTM_NEWLINK ? LinkEventType::NEW : LinkEventType::DEL);
+    event.flags = link_flags(ifi->ifi_flags);
+
+    int attrlen = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+    for (rtattr* rta = (rtattr*)IFLA_RTA(ifi); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+        switch (rta->rta_type) {
+            case IFLA_IFNAME:
+                std::strncpy(event.ifname, (char*)RTA_DATA(rta), std::min<size_t>(RTA_PAYLOAD(rta), sizeof(event.ifname)));
+                break;
+            case IFLA_ADDRESS:
+                // only ethernet-like devices have a 6 byte address
+                if (RTA_PAYLOAD(rta) == sizeof(event.mac)) {
+                    std::memcpy(event.mac, RTA_DATA(rta), sizeof(event.mac));
+                }
+                break;
+            case IFLA_MTU:
+                event.mtu = *(uint32_t*)RTA_DATA(rta);
+                break;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief
+ * Lists every link with a single RTM_GETLINK dump
+ *
+ * @param links filled with one NEW event per link
+ * @return boolean (Returns false if the dump failed, links then holds what was read)
+ */
+bool dump_links(std::vector<LinkEvent>& links) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        perror("Error opening netlink socket");
+        return false;
+    }
+
+    struct {
+        nlmsghdr nh;
+        ifinfomsg ifi;
+    } request{};
+    request.nh.nlmsg_len = sizeof(request);
+    request.nh.nlmsg_type = RTM_GETLINK;
+    request.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.nh.nlmsg_seq = 1;
+    request.ifi.ifi_family = AF_UNSPEC;
+
+    if (send(fd, &request, sizeof(request), 0) < 0) {
+        perror("Error requesting link dump");
+        close(fd);
+        return false;
+    }
+
+    std::vector<char> buf(1 << 16);
+    bool done = false;
+    bool ok = true;
+    while (!done) {
+        int n = recv(fd, buf.data(), buf.size(), 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error receiving link dump");
+            ok = false;
+            break;
+        }
+        uint64_t received_ns = now_ns_monotonic();
+
+        for (nlmsghdr* nh = (nlmsghdr*)buf.data(); NLMSG_OK(nh, (unsigned)n); nh = NLMSG_NEXT(nh, n)) {
+            if (nh->nlmsg_type == NLMSG_DONE) {
+                done = true;
+                break;
+            }
+            if (nh->nlmsg_type == NLMSG_ERROR) {
+                std::cerr << "Link dump failed: " << strerror(-((nlmsgerr*)NLMSG_DATA(nh))->error) << std::endl;
+                done = true;
+                ok = false;
+                break;
+            }
+            LinkEvent event{};
+            if (parse_link_message(nh, event)) {
+                event.received_ns = received_ns;
+                links.push_back(event);
+            }
+        }
+    }
+
+    close(fd);
+    return ok;
+}
+
+/**
+ * @brief
+ * Opens a non blocking netlink socket subscribed to link notifications
+ *
+ * @return int fd, -1 on failure
+ */
+int open_link_monitor() {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0) {
+        perror("Error opening netlink socket");
+        return -1;
+    }
+
+    sockaddr_nl address{};
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = RTMGRP_LINK;
+    if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        perror("Error subscribing to link notifications");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+#endif
@@ -2,17 +2,39 @@
 #define PACKET_HANDLER_H
 
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ctime>
+#include <array>
+#include <filesystem>
 #include <thread>
 #include <mutex>
-#include <queue>
-#include <ifaddrs.h>
+#include <condition_variable>
+#include <atomic>
+#include <map>
 #include <unordered_set>
 #include <linux/if_link.h>
-#include <sys/ioctl.h>
+#include <linux/if_packet.h>
 #include <linux/sockios.h>
 #include <cstring>
+#include <csignal>
 
 #include "linklayer/PacketSwitch.h"
+#include "linklayer/PacketRing.h"
+#include "linklayer/BatchIo.h"
+#include "linklayer/UringIo.h"
+#include "linklayer/XdpProgram.h"
+#include "linklayer/XdpSocket.h"
+#include "ForwarderConfig.h"
+#include "PacketPool.h"
+#include "PacketQueue.h"
+#include "Counter.h"
+#include "LinkEvent.h"
+#include "LinkMessage.h"
+#include "linklayer/SocketFilter.h"
+#include "linklayer/Acl.h"
 #include <unix_wrapper/UnixWrapper.h>
 #include <linklayer/RawSocket.h>
 #include <string_utils.h>
@@ -22,54 +44,114 @@
 using cpp_socket::unix_wrapper::UnixWrapper;
 using cpp_socket::linklayer::RawSocket;
 using cpp_socket::linklayer::PROMISCIOUS;
-using cpp_utils::string_utils::split;
-using cpp_utils::string_utils::convert_string;
 
-struct Packet {
-    unsigned char* data;
-    int size;
+#ifndef EPIOCSPARAMS
+// busy poll parameters of an epoll instance, Linux 6.9 uapi missing from older headers
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+struct DeviceInfo {
+    std::string ifname;
+    bool loopback;
+    bool broadcast;
+    bool multicast;
+    int mtu;
+    uint64_t mac;
+};
+
+struct PortStats {
+    // a batch is one recv()/recvmmsg() call or rx ring block
+    Counter rx_frames;
+    Counter rx_batches;
+    // a batch is one send()/sendmmsg() call or tx ring flush
+    Counter tx_frames;
+    Counter tx_batches;
+};
+
+/**
+ * @brief
+ * One worker's socket on a port with its rx/tx paths and egress queue.
+ * Only the owning worker uses it, the control path reads the counters.
+ */
+struct PortSocket {
+    RawSocket* rawSocket;
+    PacketRing* packetRing = nullptr; // only for RING modes
+    BatchIo* batchIo = nullptr; // only for BATCH modes
+    XdpSocket* xdpSocket = nullptr; // only for XDP modes, the packet socket still gets what the XDP program passes
+    RxMode rx_mode = RxMode::RECV;
+    TxMode tx_mode = TxMode::SEND;
+    bool rx = true; // false if the socket could not join the fanout group and would see every frame
+
+    PacketQueue output_buffer;
+    bool tx_ring_dirty = false; // frames queued on the tx ring since the last flush
+    bool epollout = false; // EPOLLOUT is armed in the worker's epoll set, only touched by the worker
+    bool tx_pending = false; // output buffer frames queued since the last transmit attempt
+    unsigned int tx_inflight = 0; // io_uring sends submitted and not completed yet
+    bool xdp_armed = false; // the worker filled the fill ring and put the AF_XDP socket into the XSKMAP
+    bool xdp_inflight = false; // AF_XDP sends not completed yet, listed in the worker's xdp_inflight_ports
+
+    PortStats stats;
+
+    // PACKET_STATISTICS so far, frames past the socket filter and those of them the socket queue dropped (control path)
+    uint64_t kernel_packets = 0;
+    uint64_t kernel_drops = 0;
+    // frames received on the AF_XDP socket, also counted in stats.rx_frames
+    Counter xdp_rx_frames;
+    // AF_XDP counters at the last update, they are not reset on reading like PACKET_STATISTICS (control path)
+    uint64_t xdp_packets = 0;
+    uint64_t xdp_drops = 0;
 
     /**
-     * @brief
-     * Will manage ownership and deletion of *data
+     * @brief 
+     * Will manage ownership and deletion of *rawSocket
      * 
-     * @param data 
-     * @param size 
+     * @param rawSocket 
+     * @param queue_depth
+     * @param queue_policy
      */
-    Packet(unsigned char* data, int size) {
-        this->data = data;
-        this->size = size;
+    PortSocket(RawSocket* rawSocket, unsigned int queue_depth, DropPolicy queue_policy)
+        : output_buffer(queue_depth, queue_policy) {
+        this->rawSocket = rawSocket;
     }
 
-    ~Packet() {
-        delete[] data;
+    ~PortSocket() {
+        delete xdpSocket;
+        delete packetRing;
+        delete batchIo;
+        delete rawSocket;
     }
 };
 
-
 struct Ifentry {
-    RawSocket* rawSocket;
+    uint16_t port_id = 0; // index into PortSet::ports and the mac table
+    uint64_t version = 0; // first port set holding this port, tags its epoll events with port_id
+    std::string ifname;
     bool loopback;
     bool broadcast;
     bool multicast;
     int mtu;
     uint64_t mac;
 
-    std::queue<Packet*> output_buffer;
+    // one per worker, indexed by worker id, empty for loopback which is never switched
+    std::vector<PortSocket*> sockets;
 
-    /**
-     * @brief 
-     * Will manage ownership and deletion of *rawSocket
-     * 
-     * @param rawSocket 
-     * @param loopback 
-     * @param broadcast 
-     * @param multicast 
-     * @param mtu
-     * @param mac 
-     */
-    Ifentry(RawSocket *rawSocket, bool loopback, bool broadcast, bool multicast, int mtu, uint64_t mac) {
-        this->rawSocket = rawSocket;
+    // XDP program redirecting rx queues to the sockets' AF_XDP sockets, nullptr without
+    XdpProgram* xdp = nullptr;
+
+    // set by a worker that saw the socket fail, removed by the maintenance thread
+    std::atomic<bool> failed{false};
+
+    // interface rx_packets before the sockets were opened, for the socket filter drop count
+    uint64_t rx_packets_base = 0;
+
+    Ifentry(std::string ifname, bool loopback, bool broadcast, bool multicast, int mtu, uint64_t mac) {
+        this->ifname = ifname;
         this->loopback = loopback;
         this->broadcast = broadcast;
         this->multicast = multicast;
@@ -78,91 +160,476 @@ struct Ifentry {
     }
 
     ~Ifentry() {
-        delete rawSocket;
-        
-        while (!output_buffer.empty()) {
-            Packet* curr = output_buffer.front();
-            output_buffer.pop();
-            delete curr;
+        // out of the map first, it keeps the AF_XDP sockets open and the driver filling their chunks
+        for (uint32_t queue = 0; xdp != nullptr && queue < sockets.size(); queue++) {
+            if (sockets[queue]->xdp_armed && !xdp->remove(queue)) {
+                std::cerr << ifname << ": ";
+                perror("Error removing the AF_XDP socket from the XSKMAP");
+            }
+        }
+        // the program next, so no frame is redirected to a closed socket
+        delete xdp;
+        for (PortSocket* socket: sockets) {
+            delete socket;
         }
     }
 };
 
+/**
+ * @brief
+ * Immutable snapshot of the ports, indexed by port id with nullptr for free
+ * ids. The control path publishes a new one for every change, workers pick
+ * up the latest at the start of each batch without locking. The ingress acl
+ * is compiled against the port ids of the set and owned by it, and so are
+ * the flood lists, so flooding a frame only walks the ports it may go to.
+ */
+struct PortSet {
+    uint64_t version = 0;
+    std::vector<Ifentry*> ports;
+    std::vector<std::vector<Ifentry*>> flood; // by ingress port id, every other port that is not loopback
+    Acl* acl = nullptr; // nullptr without acl rules
+
+    ~PortSet() {
+        delete acl;
+    }
+};
+
+/**
+ * @brief a replaced port set waiting for the workers to leave it
+ */
+struct RetiredPortSet {
+    PortSet* set;
+    PortSet* successor; // the set that replaced it, gets its acl hits
+    Ifentry* removed; // the port it was replaced to remove, nullptr if none
+};
+
+/**
+ * @brief a received frame waiting in a batch
+ */
+struct RxFrame {
+    unsigned char* data;
+    int size;
+    uint16_t vlan; // id of the tag the kernel took off, NO_VLAN if none
+    Packet* owner; // pool packet holding data whose ownership passes on, nullptr if data points into a rx ring
+};
+
+/**
+ * @brief a send in flight on a worker's io_uring
+ */
+struct UringSend {
+    Packet* packet;
+    uint64_t port_tag; // epoll tag of the egress port
+};
+
+/**
+ * @brief
+ * A packet processor thread with its own epoll set. With more than one
+ * worker every port has a socket per worker in a PACKET_FANOUT group, so
+ * the kernel spreads the frames of a port over the workers.
+ */
+struct Worker {
+    unsigned int id;
+    int ep;
+
+    // port set of the current batch
+    PortSet* port_set = nullptr;
+    // its version, a freed set's address may come back for the next one so changes go by version
+    uint64_t port_set_version = ~(uint64_t)0;
+    // the port set of the current batch, nullptr between batches; retired sets are freed once no worker announces them
+    std::atomic<PortSet*> announced{nullptr};
+
+    // events for ports that are newer than port_set, handled next batch
+    std::vector<epoll_event> deferred;
+
+    // set once the worker switched its first frame, for the startup timing
+    bool switched = false;
+
+    uint64_t now_ns = 0; // clock of the current batch
+
+    // ports with unflushed tx ring frames in the current batch
+    std::vector<uint16_t> tx_ring_dirty_ports;
+    // epoll tags of ports whose tx ring the kernel had no room for, flushed again next round
+    std::vector<uint64_t> tx_ring_retry_ports;
+
+    // ports with output buffer frames of the current rx batch, sent at its end
+    std::vector<uint16_t> tx_pending_ports;
+
+    // scratch space for sendmmsg() batches
+    std::vector<iovec> tx_iovecs;
+
+    // frames of one port waiting for forward_batch() with their parsed headers
+    std::vector<RxFrame> rx_batch;
+    std::vector<const unsigned char*> rx_headers;
+    std::vector<FrameKeys> rx_keys;
+    // copies of headers too short for the 16 byte loads of the classifier
+    std::vector<std::array<unsigned char, 16>> short_headers;
+
+    // receive target for frames that found the pool exhausted
+    std::vector<unsigned char> discard;
+
+    // switching decisions of this worker's flows, nullptr if disabled
+    FlowCache* flow_cache = nullptr;
+
+    // io_engine io_uring only, nullptr with epoll
+    UringIo* uring = nullptr;
+    // epoll tags of the sockets with a multishot receive armed
+    std::vector<uint64_t> uring_armed;
+    // a multishot receive ended and has to be armed again
+    bool uring_rearm = false;
+    // receive buffers of rx_batch, recycled once it is forwarded
+    std::vector<uint16_t> uring_rx_buffers;
+    // packets of the sends in flight by slot, free slots listed in uring_free_sends
+    std::vector<UringSend> uring_sends;
+    std::vector<uint32_t> uring_free_sends;
+
+    // chunks of this worker's AF_XDP sockets, nullptr until a port gets one
+    XdpUmem* xdp_umem = nullptr;
+    // epoll tags of the ports with AF_XDP sends the kernel has not completed, their chunks are freed as it does
+    std::vector<uint64_t> xdp_inflight_ports;
+
+    Counter rx_frames;
+    Counter tx_frames;
+    Counter syscalls; // epoll, receive and transmit calls on the packet path
+    // counters at the last print_stats() for the rates
+    uint64_t last_rx_frames = 0;
+    uint64_t last_tx_frames = 0;
+    uint64_t last_syscalls = 0;
+
+    // clock of the last round with events, poll_mode adaptive polls for poll_budget_us after it
+    uint64_t last_event_ns = 0;
+
+    // cpu time clock of the worker thread, set by run() (control path)
+    clockid_t cpu_clock{};
+    bool has_cpu_clock = false;
+    uint64_t last_cpu_ns = 0;
+
+    ~Worker() {
+        delete flow_cache;
+        delete uring;
+        delete xdp_umem;
+    }
+};
+
 class PacketHandler {
     public:
-    PacketHandler() {
-        ep = epoll_create1(EPOLL_CLOEXEC);
-        update_devices();
+    PacketHandler(ForwarderConfig config = ForwarderConfig())
+        : packetSwitch(config.mac_table_size, (uint64_t)config.mac_aging_timeout * 1'000'000'000) {
+        start_ns = now_ns_monotonic();
+        this->config = config;
+
+        if (config.link_monitor == LinkMonitor::NETLINK) {
+            // subscribe before the dump so no change slips in between, replaying one is harmless
+            link_monitor_fd = open_link_monitor();
+        }
+
+        std::vector<DeviceInfo> devices = discover_devices();
+        discovered_devices = devices.size();
+        discovered_ns = now_ns_monotonic() - start_ns;
+
+        // size the pool for the largest port mtu present at startup
+        int frame_size = config.pool_frame_size;
+        if (frame_size == 0) {
+            int mtu = 1500;
+            for (auto& device: devices) {
+                if (!device.loopback) {
+                    mtu = std::max(mtu, device.mtu);
+                }
+            }
+            frame_size = sizeof(ether_header) + mtu;
+        }
+        packetPool = new PacketPool(frame_size, config.pool_buffers);
+        port_set = new PortSet();
+
+        for (unsigned int i = 0; i < config.workers; i++) {
+            Worker* worker = new Worker();
+            worker->id = i;
+            worker->ep = epoll_create1(EPOLL_CLOEXEC);
+            worker->discard.resize(frame_size);
+            worker->rx_batch.reserve(config.batch_size);
+            if (config.flow_cache_size > 0) {
+                worker->flow_cache = new FlowCache(config.flow_cache_size);
+            }
+            workers.push_back(worker);
+        }
+        open_urings(frame_size);
+        enable_epoll_busy_poll();
+        last_stats_ns = now_ns_monotonic();
+
+        if (link_monitor_fd >= 0) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.u64 = LINK_MONITOR_TAG;
+            if (epoll_ctl(workers[0]->ep, EPOLL_CTL_ADD, link_monitor_fd, &ev) == -1) {
+                perror("Error registering the link monitor");
+            }
+        }
+
+        for (auto& device: devices) {
+            update_device(device.ifname, device.loopback, device.broadcast, device.multicast, device.mtu, device.mac);
+        }
+        ports_ready_ns = now_ns_monotonic() - start_ns;
     }
 
     void update_device(std::string ifname, bool loopback, bool broadcast, bool multicast, int mtu, uint64_t mac) {
-        m.lock();
+        control_m.lock();
+        if (namemap.contains(ifname) && namemap.at(ifname)->failed) {
+            // it went down and up again, maybe within one coalesced link event, open it anew
+            remove_port(namemap.at(ifname)->port_id);
+        }
+        if (!namemap.contains(ifname) && retiring_device(ifname)) {
+            // its sockets and XDP program stay until the workers left the old port, added after that
+            pending_devices[ifname] = DeviceInfo{ifname, loopback, broadcast, multicast, mtu, mac};
+            control_m.unlock();
+            return;
+        }
         if (!namemap.contains(ifname)) {
-            RawSocket* rawSocket = new RawSocket(ifname, PROMISCIOUS, false);
-            
-            if (!loopback) {
-                // do not register loopback for epoll
-                register_socket_epoll(rawSocket->get_socket());
+            std::vector<Ifentry*> ports = port_set.load()->ports;
+            int port_id = allocate_port_id(ports);
+            if (port_id < 0) {
+                std::cerr << "Out of port ids, ignoring " << ifname << std::endl;
+                control_m.unlock();
+                return;
             }
-            
-            // To read from dummy interfaces while testing, this needs to be disabled
-            rawSocket->set_ignore_outgoing(1);
-
-            // Disable pause frames
-            // rawSocket->set_pause_frames(0);
 
-            int rc = 0;
-            // 1) Turn off RX/TX checksum offload
-            // rc |= rawSocket->ethtool_set_value(ETHTOOL_SRXCSUM, 0);
-            // rc |= rawSocket->ethtool_set_value(ETHTOOL_STXCSUM, 0);
+            #ifndef NDEBUG
+            std::cerr << "Adding " << ifname << " " << loopback << " " << broadcast << " " << multicast << " " << mtu << std::endl;
+            #endif
 
-            // 2) Turn off GRO/LRO
-            // rc |= rawSocket->ethtool_set_value(ETHTOOL_SGRO, 0);       // GRO
-            // LRO might be only in flags on older kernels
-            // rc |= rawSocket->ethtool_clear_flags(ETH_FLAG_LRO);
+            if (!loopback && (int)sizeof(ether_header) + mtu > packetPool->get_frame_size()) {
+                std::cerr << ifname << " mtu " << mtu << " exceeds the packet pool frame size, larger frames will be dropped" << std::endl;
+            }
 
-            // 3) Turn off GSO/TSO (generic + specific)
-            // rc |= rawSocket->ethtool_set_value(ETHTOOL_SGSO, 0);       // generic segmentation offload
-            // rc |= rawSocket->ethtool_set_value(ETHTOOL_STSO, 0);       // TCP segmentation offload
+            Ifentry* ifentry = new Ifentry(ifname, loopback, broadcast, multicast, mtu, mac);
+            ifentry->port_id = port_id;
+            ifentry->version = port_set.load()->version + 1;
 
-            #ifndef NDEBUG
-            std::cerr << "Adding " << rawSocket->get_ifname() << " " << loopback << " " << broadcast << " " << multicast << " " << mtu << std::endl;
-            #endif
+            if (!loopback) {
+                // do not open sockets on loopback
+                ifentry->rx_packets_base = interface_rx_packets(ifname);
+                int fanout_group = 0;
+                for (Worker* worker: workers) {
+                    PortSocket* socket = open_port_socket(ifname);
+                    if (workers.size() > 1) {
+                        // only the first worker keeps receiving if no group could be formed
+                        bool joined = (worker->id == 0 || fanout_group != 0)
+                            && join_fanout(socket->rawSocket->get_socket(), fanout_group);
+                        socket->rx = joined || worker->id == 0;
+                    }
+                    ifentry->sockets.push_back(socket);
+                }
+                if (wants_xdp(ifname)) {
+                    // AF_XDP where it can be had, the packet socket paths for the rest
+                    open_port_xdp(ifentry);
+                    for (PortSocket* socket: ifentry->sockets) {
+                        if (socket->xdpSocket == nullptr) {
+                            setup_port_io(socket, config.port(ifname));
+                        }
+                    }
+                }
+                for (Worker* worker: workers) {
+                    register_socket_epoll(*worker, ifentry);
+                }
+            }
 
-            Ifentry* ifentry = new Ifentry(rawSocket, loopback, broadcast, multicast, mtu, mac);
             namemap.insert({ifname, ifentry});
-            fdmap.insert({rawSocket->get_socket(), ifentry});
+            ports[port_id] = ifentry;
+            publish_port_set(ports);
         }
         else {
             namemap.at(ifname)->mtu = mtu;
         }
-        m.unlock();
+        control_m.unlock();
     }
 
     void remove_device(std::string ifname) {
-        m.lock();
+        control_m.lock();
+        pending_devices.erase(ifname);
         if (namemap.contains(ifname)) {
-            Ifentry* ifentry = namemap.at(ifname);
-            #ifndef NDEBUG
-            std::cerr << "Removing " << ifentry->rawSocket->get_ifname() << std::endl;
-            #endif
-            packetSwitch.macTable.removeInterface(ifentry->rawSocket->get_ifname());
-            fdmap.erase(ifentry->rawSocket->get_socket());
-            namemap.erase(ifname);
-            delete ifentry;
+            remove_port(namemap.at(ifname)->port_id);
+        }
+        control_m.unlock();
+    }
+
+    /**
+     * @brief removes the ports a worker saw failing
+     */
+    void remove_failed_ports() {
+        control_m.lock();
+        // remove_port() replaces the port set, walk a copy
+        std::vector<Ifentry*> ports = port_set.load()->ports;
+        for (Ifentry* ifentry: ports) {
+            if (ifentry != nullptr && ifentry->failed) {
+                remove_port(ifentry->port_id);
+            }
+        }
+        control_m.unlock();
+    }
+
+    void print_stats() {
+        control_m.lock();
+        uint64_t now_ns = now_ns_monotonic();
+        double seconds = (now_ns - last_stats_ns) / 1e9;
+        last_stats_ns = now_ns;
+
+        std::cerr << "---------------" << std::endl;
+        for (auto it=namemap.begin(); it!=namemap.end(); it++) {
+            if (it->second->loopback) {
+                continue;
+            }
+            uint64_t rx_frames = 0;
+            uint64_t rx_batches = 0;
+            uint64_t tx_frames = 0;
+            uint64_t tx_batches = 0;
+            uint64_t enqueued = 0;
+            uint64_t dropped = 0;
+            uint64_t high_water = 0;
+            uint64_t kernel_drops = 0;
+            for (PortSocket* socket: it->second->sockets) {
+                update_kernel_stats(socket);
+                kernel_drops += socket->kernel_drops;
+                rx_frames += socket->stats.rx_frames.get();
+                rx_batches += socket->stats.rx_batches.get();
+                tx_frames += socket->stats.tx_frames.get();
+                tx_batches += socket->stats.tx_batches.get();
+                enqueued += socket->output_buffer.enqueued.get();
+                dropped += socket->output_buffer.dropped.get();
+                high_water = std::max(high_water, socket->output_buffer.high_water.get());
+            }
+            std::cerr << it->first
+                << " rx " << rx_frames << " frames " << rx_batches << " batches"
+                << " (avg " << average_fill(rx_frames, rx_batches) << ")"
+                << " tx " << tx_frames << " frames " << tx_batches << " batches"
+                << " (avg " << average_fill(tx_frames, tx_batches) << ")"
+                << " queue " << enqueued << " enqueued " << dropped << " dropped"
+                << " high water " << high_water << "/" << socket_queue_capacity(it->second)
+                << " kernel " << kernel_drops << " dropped " << filtered_frames(it->second) << " filtered" << std::endl;
+        }
+        for (Worker* worker: workers) {
+            uint64_t rx_frames = worker->rx_frames.get();
+            uint64_t tx_frames = worker->tx_frames.get();
+            uint64_t syscalls = worker->syscalls.get();
+            uint64_t cpu_ns = thread_cpu_ns(worker);
+            std::cerr << "worker " << worker->id
+                << " rx " << (uint64_t)((rx_frames - worker->last_rx_frames) / seconds) << " pps"
+                << " tx " << (uint64_t)((tx_frames - worker->last_tx_frames) / seconds) << " pps"
+                << " syscalls " << (uint64_t)((syscalls - worker->last_syscalls) / seconds) << "/s"
+                << " (" << average_fill(syscalls - worker->last_syscalls, rx_frames - worker->last_rx_frames) << " per frame)"
+                << " cpu " << (uint64_t)((cpu_ns - worker->last_cpu_ns) / 1e7 / seconds) << "%";
+            if (worker->flow_cache != nullptr) {
+                uint64_t hits = worker->flow_cache->hits.get();
+                uint64_t misses = worker->flow_cache->misses.get();
+                std::cerr << " flow cache " << hits << " hits " << misses << " misses"
+                    << " (" << (hits + misses ? 100 * hits / (hits + misses) : 0) << "% hit)";
+            }
+            std::cerr << std::endl;
+            worker->last_rx_frames = rx_frames;
+            worker->last_tx_frames = tx_frames;
+            worker->last_syscalls = syscalls;
+            worker->last_cpu_ns = cpu_ns;
         }
-        m.unlock();
+        std::cerr << "mac table " << packetSwitch.macTable.size() << " entries"
+            << " learn dropped " << packetSwitch.macTable.learn_dropped
+            << " aged out " << packetSwitch.macTable.aged_out << std::endl;
+        PoolStats pool_stats = packetPool->get_stats();
+        std::cerr << "pool " << pool_stats.in_use << "/" << pool_stats.buffers << " in use"
+            << " high water " << pool_stats.high_water
+            << " exhausted " << pool_stats.exhausted << std::endl;
+        Acl* acl = port_set.load()->acl;
+        if (acl != nullptr) {
+            std::cerr << "acl " << acl->get_rules().size() << " rules in " << acl->group_count() << " groups" << std::endl;
+            for (uint32_t i = 0; i < acl->get_rules().size(); i++) {
+                uint64_t hits = acl->get_hits(i);
+                if (hits > 0) {
+                    std::cerr << "  " << acl->get_rules()[i].text << " hits " << hits << std::endl;
+                }
+            }
+        }
+        std::cerr << "link events " << link_events.get()
+            << " latency last " << link_latency_last_ns.get() / 1000 << " us"
+            << " max " << link_latency_max_ns.get() / 1000 << " us" << std::endl;
+        uint64_t first_switched = first_switched_ns.load(std::memory_order_relaxed);
+        std::cerr << "startup " << discovered_devices << " devices discovered in " << discovered_ns / 1000 << " us"
+            << " ports ready after " << ports_ready_ns / 1000 << " us"
+            << " first frame switched after ";
+        if (first_switched != 0) {
+            std::cerr << first_switched / 1000 << " us" << std::endl;
+        }
+        else {
+            std::cerr << "none yet" << std::endl;
+        }
+        std::cerr << "---------------" << std::endl;
+        control_m.unlock();
     }
 
     void run(std::string address) {
-        std::thread packet_processor_thread([&]() {
-            packet_processor();
-        });
+        std::vector<std::thread> worker_threads;
+        for (Worker* worker: workers) {
+            worker_threads.emplace_back([this, worker]() {
+                packet_processor(*worker);
+            });
+            worker->has_cpu_clock = pthread_getcpuclockid(worker_threads.back().native_handle(), &worker->cpu_clock) == 0;
+        }
 
-        std::thread device_manager_communication_thread([&]() {
-            device_manager_communication(address);
-        });
+        // with the netlink link monitor the first worker handles link events itself
+        std::thread device_manager_communication_thread;
+        if (link_monitor_fd < 0) {
+            device_manager_communication_thread = std::thread([&]() {
+                device_manager_communication(address);
+            });
+        }
         
+        struct sigaction sa{};
+        sa.sa_handler = sighup_handler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGHUP, &sa, nullptr);
+
+        std::thread maintenance_thread([&]() {
+            unsigned int seconds = 0;
+            auto next_second = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+            while (true) {
+                std::vector<DeviceInfo> ready;
+                {
+                    // retired port sets are checked until the workers left them, the rest runs once a second
+                    std::unique_lock<std::mutex> lock(control_m);
+                    if (retired_port_sets.empty()) {
+                        reclaim_cv.wait_until(lock, next_second);
+                    }
+                    else {
+                        reclaim_cv.wait_for(lock, std::chrono::microseconds(50));
+                    }
+                    reclaim_port_sets();
+                    for (auto it = pending_devices.begin(); it != pending_devices.end();) {
+                        if (retiring_device(it->first)) {
+                            it++;
+                            continue;
+                        }
+                        ready.push_back(it->second);
+                        it = pending_devices.erase(it);
+                    }
+                }
+                for (DeviceInfo& device: ready) {
+                    update_device(device.ifname, device.loopback, device.broadcast, device.multicast, device.mtu, device.mac);
+                }
+                if (std::chrono::steady_clock::now() < next_second) {
+                    continue;
+                }
+                next_second += std::chrono::seconds(1);
+                seconds++;
+
+                remove_failed_ports();
+
+                if (reload_requested) {
+                    reload_requested = 0;
+                    reload_config();
+                }
+
+                if (config.stats_interval > 0 && seconds % config.stats_interval == 0) {
+                    print_stats();
+                }
+            }
+        });
+
         #ifndef NDEBUG
         std::thread debug_info_thread([&]() {
             while (true) {
@@ -174,79 +641,109 @@ class PacketHandler {
         debug_info_thread.join();
         #endif
 
-        packet_processor_thread.join();
-        device_manager_communication_thread.join();
+        for (auto& worker_thread: worker_threads) {
+            worker_thread.join();
+        }
+        if (device_manager_communication_thread.joinable()) {
+            device_manager_communication_thread.join();
+        }
+        maintenance_thread.join();
     }
 
-    void update_devices() {
-        ifaddrs *ifs = nullptr;
-
-        if (getifaddrs(&ifs) == -1) {
-            perror("Error updating devices");
+    /**
+     * @brief
+     * Re-reads the config file. The mac aging timeout, stats interval,
+     * socket filters and acl rules take effect right away, the other port
+     * options apply to ports added afterwards and pool and table sizes as
+     * well as the worker count need a restart.
+     */
+    void reload_config() {
+        if (config.path.empty()) {
             return;
         }
 
-        // Reuse one socket for all ioctls
-        int sock = socket(AF_INET, SOCK_DGRAM, 0);
-        if (sock == -1) {
-            perror("socket");
-            freeifaddrs(ifs);
+        ForwarderConfig new_config;
+        try {
+            new_config = ForwarderConfig(config.path);
+        } catch (std::invalid_argument& e) {
+            std::cerr << "Keeping the current config: " << e.what() << std::endl;
             return;
         }
 
-        for (auto *p = ifs; p; p = p->ifa_next) {
-            // IF_LOWER_UP 1 << 16
-            if (!p || !p->ifa_name || !(p->ifa_flags & (1 << 16))) {
+        control_m.lock();
+        config = new_config;
+        packetSwitch.macTable.setAgingTimeout((uint64_t)config.mac_aging_timeout * 1'000'000'000);
+        for (Ifentry* ifentry: port_set.load()->ports) {
+            if (ifentry == nullptr) {
                 continue;
             }
+            for (PortSocket* socket: ifentry->sockets) {
+                attach_filter(socket->rawSocket, config.port(ifentry->ifname));
+            }
+            const PortConfig& port_config = config.port(ifentry->ifname);
+            if (ifentry->xdp != nullptr && !ifentry->xdp->update_filter(port_config.blocked_macs, port_config.blocked_ethertypes)) {
+                std::cerr << ifentry->ifname << ": ";
+                perror("Error replacing the XDP program");
+            }
+        }
+        // same ports, recompiled acl
+        publish_port_set(port_set.load()->ports);
+        control_m.unlock();
 
-            bool loopback  = (p->ifa_flags & IFF_LOOPBACK)   != 0;
-            bool broadcast = (p->ifa_flags & IFF_BROADCAST)  != 0;
-            bool multicast = (p->ifa_flags & IFF_MULTICAST)  != 0;
+        std::cerr << "Reloaded " << config.path << std::endl;
+    }
 
-            // Get MTU
-            int mtu = 1500; // fallback
-            struct ifreq ifr{};
-            std::strncpy(ifr.ifr_name, p->ifa_name, IFNAMSIZ - 1);
-            if (ioctl(sock, SIOCGIFMTU, &ifr) == 0) {
-                mtu = ifr.ifr_mtu;
-            }
+    void update_devices() {
+        for (auto& device: discover_devices()) {
+            update_device(device.ifname, device.loopback, device.broadcast, device.multicast, device.mtu, device.mac);
+        }
+    }
 
-            // Get MAC (only meaningful for Ethernet-like devices)
-            std::string mac;
-            std::memset(&ifr, 0, sizeof(ifr));
-            std::strncpy(ifr.ifr_name, p->ifa_name, IFNAMSIZ - 1);
-            if (ioctl(sock, SIOCGIFHWADDR, &ifr) == 0) {
-                if (ifr.ifr_hwaddr.sa_family == 1) {
-                    const unsigned char* hw = reinterpret_cast<unsigned char*>(ifr.ifr_hwaddr.sa_data);
-                    char buf[18];
-                    std::snprintf(buf, sizeof(buf),
-                                "%02x:%02x:%02x:%02x:%02x:%02x",
-                                hw[0], hw[1], hw[2], hw[3], hw[4], hw[5]);
-                    mac.assign(buf);
-                }
-            }
+    /**
+     * @brief links that are up, from one RTM_GETLINK dump
+     *
+     * @return std::vector<DeviceInfo>
+     */
+    std::vector<DeviceInfo> discover_devices() {
+        std::vector<DeviceInfo> devices;
+        std::vector<LinkEvent> links;
+
+        if (!dump_links(links)) {
+            std::cerr << "Device discovery incomplete, " << links.size() << " links listed" << std::endl;
+        }
 
-            // assume update_device(name, loopback, broadcast, multicast, mtu, mac)
-            update_device(p->ifa_name, loopback, broadcast, multicast, mtu, pack_mac_str(mac));
+        for (auto& link: links) {
+            if (!(link.flags & LINK_LOWER_UP)) {
+                continue;
+            }
+            std::string ifname(link.ifname, strnlen(link.ifname, sizeof(link.ifname)));
+            int mtu = link.mtu == 0 ? 1500 : link.mtu;
+            devices.push_back({ifname, (link.flags & LINK_LOOPBACK) != 0, (link.flags & LINK_BROADCAST) != 0,
+                (link.flags & LINK_MULTICAST) != 0, mtu, pack_mac_bytes(link.mac)});
         }
 
-        close(sock);
-        freeifaddrs(ifs);
+        return devices;
     }
 
     void print_mactable() {
-        m.lock();
+        control_m.lock();
         std::cerr << "---------------" << std::endl;
-        for (auto it=packetSwitch.macTable.table.begin(); it!=packetSwitch.macTable.table.end(); it++) {
+        std::map<std::string, std::vector<uint64_t>> by_port;
+        std::vector<Ifentry*>& ports = port_set.load()->ports;
+        packetSwitch.macTable.forEach([&](uint64_t mac, uint16_t port, uint64_t) {
+            if (port < ports.size() && ports[port] != nullptr) {
+                by_port[ports[port]->ifname].push_back(mac);
+            }
+        });
+        for (auto it=by_port.begin(); it!=by_port.end(); it++) {
             std::cerr << it->first << std::endl;
-            for (auto it2=it->second.begin(); it2!=it->second.end(); it2++) {
-                std::vector<unsigned char> bytes = unpack_mac_bytes(it2->first);
+            for (uint64_t mac: it->second) {
+                std::vector<unsigned char> bytes = unpack_mac_bytes(mac);
                 std::cerr << "\t" << mac_to_str(bytes.data()) << std::endl;
             }
         }
         std::cerr << "---------------" << std::endl;
-        m.unlock();
+        control_m.unlock();
     }
 
     ~PacketHandler() {
@@ -254,238 +751,1876 @@ class PacketHandler {
             delete it->second;
         }
         namemap.clear();
-        fdmap.clear();
-        if (ep >= 0) {
-            close(ep);
+        for (RetiredPortSet& retired: retired_port_sets) {
+            delete retired.removed;
+            delete retired.set;
+        }
+        delete port_set.load();
+        for (Worker* worker: workers) {
+            if (worker->ep >= 0) {
+                close(worker->ep);
+            }
+            delete worker;
+        }
+        if (link_monitor_fd >= 0) {
+            close(link_monitor_fd);
         }
+        delete packetPool;
     }
 
     private:
-    /**
-     * @brief register the socket for epoll (not thread safe)
-     * 
-     * @param sockfd 
-     */
-    void register_socket_epoll(int sockfd) {
-        epoll_event ev{};
-        ev.events  = EPOLLIN | EPOLLET;
-        ev.data.fd = sockfd;
+    inline static volatile sig_atomic_t reload_requested = 0;
 
-        if (epoll_ctl(ep, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
-            perror("Error adding socket to epoll");
-            // Common cases: EEXIST (already added), EBADF/ENOENT (bad fd)
-            // TODO: HANDLE ERROR
-            return;
-        }
+    static void sighup_handler(int) {
+        reload_requested = 1;
     }
 
     /**
-     * @brief removes the socket (not thread safe)
-     * 
-     * @param sockfd 
+     * @brief cpu time worker's thread used so far, 0 if unknown
+     *
+     * @param worker
+     * @return uint64_t
      */
-    void remove_socket(int sockfd) {
-        if (fdmap.contains(sockfd)) {
-            Ifentry* ifentry = fdmap.at(sockfd);
-            #ifndef NDEBUG
-            std::cerr << "Removing " << ifentry->rawSocket->get_ifname() << std::endl;
-            #endif
-            fdmap.erase(sockfd);
-            std::string ifname = ifentry->rawSocket->get_ifname();
-            namemap.erase(ifname);
-            packetSwitch.macTable.removeInterface(ifentry->rawSocket->get_ifname());
-            delete ifentry;
+    static uint64_t thread_cpu_ns(Worker* worker) {
+        timespec ts{};
+        if (!worker->has_cpu_clock || clock_gettime(worker->cpu_clock, &ts) == -1) {
+            return 0;
         }
+        return (uint64_t)ts.tv_sec * 1'000'000'000 + ts.tv_nsec;
     }
 
-    void set_epollout(int fd, bool has_output) {
-        epoll_event ev{};
-        ev.events = EPOLLIN | EPOLLET;
-        if (has_output) {
-            ev.events |= EPOLLOUT;
-        }
-        ev.data.fd = fd;
-    
-        // First try to modify (most common case)
-        if (epoll_ctl(ep, EPOLL_CTL_MOD, fd, &ev) == -1) {
-            if (errno == ENOENT) {
-                // fd not registered
-                // if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
-                //     // TODO: HANDLE ERROR
-                // }
-                perror("Tried to set epollout for unregistered fd");
-            } else {
-                // TODO: HANDLE ERROR(S)
-                perror("Error setting epollout for fd");
-            }
-        }
+    static double average_fill(uint64_t frames, uint64_t batches) {
+        return batches ? (double)frames / batches : 0;
     }
 
-    void device_manager_communication(std::string address) {
-        UnixWrapper unixWrapper(address, true, true);
-        while (1) {
-            char buffer[64];
-            int r = unixWrapper.receive_wrapper(buffer, 64, 0);
-
-            if (r < 0) {
-                perror("Error communicating with device manager");
-            }
-            else if (r == 0) {
-                std::cerr << "Device manager pipe closed unexpectedly." << std::endl;
-                break;
-            };
-
-            std::string message(buffer, r);
-            std::vector<std::string> tokens = split(message, ' ');
-
-            if (tokens[1] == "NEW") {
-                // ifname NEW <LOOPBACK,BROADCAST,MULTICAST,LOWER_UP> <mtu> <mac>
-                
-                #ifndef NDEBUG
-                std::cerr << message << std::endl;
-                #endif
-
-                int mtu = convert_string<int>(tokens[3]);
+    static size_t socket_queue_capacity(Ifentry* ifentry) {
+        return ifentry->sockets.empty() ? 0 : ifentry->sockets[0]->output_buffer.capacity();
+    }
 
-                if (mtu == 0) {
-                    mtu = 1500;
-                }
+    // epoll tag of the link monitor, no port set reaches that version
+    static constexpr uint64_t LINK_MONITOR_TAG = ~(uint64_t)0;
+    // set in the epoll tag of an AF_XDP socket next to its port's packet socket
+    static constexpr uint64_t XDP_TAG = (uint64_t)1 << 63;
+    // submission queue size of every worker's io_uring
+    static constexpr unsigned int URING_ENTRIES = 1024;
 
-                tokens[2].erase(0, 1);
-                tokens[2].erase(tokens[2].size() - 1);
+    static uint64_t epoll_tag(Ifentry* ifentry) {
+        return ifentry->version << 16 | ifentry->port_id;
+    }
 
-                std::vector<std::string> ifflag_tokens = split(tokens[2], ',');
-                std::unordered_set<std::string> ifflag_set(ifflag_tokens.begin(), ifflag_tokens.end());
+    /**
+     * @brief
+     * Swaps in a port set holding ports. The previous one is retired rather
+     * than waited for, so the caller (the first worker with the netlink link
+     * monitor) goes on forwarding; it is freed, with removed, once no worker
+     * reads it any more (control path).
+     *
+     * @param ports
+     * @param removed port missing from ports, freed with the previous set
+     */
+    void publish_port_set(const std::vector<Ifentry*>& ports, Ifentry* removed = nullptr) {
+        PortSet* old_set = port_set.load();
+        PortSet* new_set = new PortSet{old_set->version + 1, ports, flood_lists(ports), compile_acl(ports)};
+        port_set.store(new_set);
+
+        retired_port_sets.push_back(RetiredPortSet{old_set, new_set, removed});
+        // workers between batches have left it already
+        if (!reclaim_port_sets()) {
+            reclaim_cv.notify_one();
+        }
+    }
 
-                if (ifflag_set.contains("LOWER_UP")) {
-                    update_device(
-                        tokens[0], ifflag_set.contains("LOOPBACK"), 
-                        ifflag_set.contains("BROADCAST"), ifflag_set.contains("MULTICAST"),
-                        mtu, pack_mac_str(tokens[4]));
-                } else {
-                    remove_device(tokens[0]);
-                }
+    /**
+     * @brief
+     * Frees the retired port sets, oldest first, that no worker announces
+     * any more, along with the ports removed from them. A worker announces
+     * the set of its batch, and whatever it enters next is newer, so one
+     * seen announcing another set or none has left it for good (control path).
+     *
+     * @return true if none are left
+     */
+    bool reclaim_port_sets() {
+        size_t reclaimed = 0;
+        for (RetiredPortSet& retired: retired_port_sets) {
+            bool in_use = false;
+            for (Worker* worker: workers) {
+                in_use = in_use || worker->announced.load() == retired.set;
             }
+            if (in_use) {
+                // the newer ones carry its acl hits on, keep the order
+                break;
+            }
+            if (retired.successor->acl != nullptr && retired.set->acl != nullptr) {
+                retired.successor->acl->carry_hits(*retired.set->acl);
+            }
+            if (retired.removed != nullptr) {
+                // workers on the retired set may have learned on the port until now
+                packetSwitch.removePort(retired.removed->port_id);
+                delete retired.removed;
+            }
+            delete retired.set;
+            reclaimed++;
         }
+        retired_port_sets.erase(retired_port_sets.begin(), retired_port_sets.begin() + reclaimed);
+        return retired_port_sets.empty();
     }
 
     /**
-     * @brief receive a single packet from fd (not thread safe)
-     * 
-     * @param fd 
-     * @return boolean (Returns false if fd is not readable) 
+     * @brief true if a removed port on ifname still waits for the workers to leave it (control path)
+     *
+     * @param ifname
      */
-    bool receive_packet(int fd) {
-        unsigned char* packet;
-        int mtu;
-        std::string src_ifname;
-        if (fdmap.contains(fd)) {
-            mtu = fdmap.at(fd)->mtu;
-            src_ifname = fdmap.at(fd)->rawSocket->get_ifname();
-        }
-        else {
-            return false;
+    bool retiring_device(const std::string& ifname) {
+        for (RetiredPortSet& retired: retired_port_sets) {
+            if (retired.removed != nullptr && retired.removed->ifname == ifname) {
+                return true;
+            }
         }
+        return false;
+    }
 
-        int frame_size = sizeof(ether_header) + mtu;
-
-        packet = new unsigned char[frame_size];
-        int r = recv(fd, packet, frame_size, 0);
-
-        if (r < 0) {
-            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
-                remove_socket(fd);
+    /**
+     * @brief true if port_id belongs to a removed port the workers may still reach (control path)
+     *
+     * @param port_id
+     */
+    bool retiring_port_id(size_t port_id) {
+        for (RetiredPortSet& retired: retired_port_sets) {
+            if (retired.removed != nullptr && retired.removed->port_id == port_id) {
+                return true;
             }
-            delete[] packet;
-            return false;
         }
+        return false;
+    }
 
-        std::string out_ifname = packetSwitch.switchPacket(src_ifname, packet, r);
-
-        if (out_ifname == "") {
-            // UNICAST FLOODING
-            for (auto it=namemap.begin(); it!=namemap.end(); it++) {
-                if (it->first == src_ifname || it->second->loopback) {
-                    continue;
+    /**
+     * @brief
+     * The egress ports of a flooded frame for every ingress port of ports (control path)
+     *
+     * @param ports
+     * @return std::vector<std::vector<Ifentry*>> indexed like ports
+     */
+    std::vector<std::vector<Ifentry*>> flood_lists(const std::vector<Ifentry*>& ports) {
+        std::vector<std::vector<Ifentry*>> flood(ports.size());
+        for (Ifentry* src: ports) {
+            if (src == nullptr || src->loopback) {
+                continue;
+            }
+            for (Ifentry* ifentry: ports) {
+                if (ifentry != nullptr && ifentry != src && !ifentry->loopback) {
+                    flood[src->port_id].push_back(ifentry);
                 }
-                unsigned char* packet_copy = new unsigned char[r];
-                memcpy(packet_copy, packet, r);
-                it->second->output_buffer.push(new Packet(packet_copy, r));
-                set_epollout(it->second->rawSocket->get_socket(), true);
             }
-            delete[] packet;
-        } else if (out_ifname == "DROP") {
-            delete[] packet;
         }
-        else if (namemap.contains(out_ifname)){
-            Ifentry *ifentry = namemap.at(out_ifname);
-            set_epollout(ifentry->rawSocket->get_socket(), true);
-            ifentry->output_buffer.push(new Packet(packet, r));
+        return flood;
+    }
+
+    /**
+     * @brief
+     * Compiles the acl rules of the config for the port ids of ports (control path)
+     *
+     * @param ports
+     * @return Acl* nullptr if there are no rules
+     */
+    Acl* compile_acl(const std::vector<Ifentry*>& ports) {
+        if (config.acl_rules.empty()) {
+            return nullptr;
         }
-        else {
-            #ifndef NDEBUG
-            std::cerr << "Switching error to unknown ifname: " << out_ifname << std::endl;
-            #endif
-            delete[] packet;
+        std::unordered_map<std::string, uint16_t> port_ids;
+        for (Ifentry* ifentry: ports) {
+            if (ifentry != nullptr) {
+                port_ids.insert({ifentry->ifname, ifentry->port_id});
+            }
         }
-
-        return true;
+        return new Acl(config.acl_rules, port_ids, workers.size());
     }
-    
-    void packet_processor() {
-        std::vector<epoll_event> events(256);
 
-        while (true) {
-            int n = epoll_wait(ep, events.data(), static_cast<int>(events.size()), -1);
-            if (n < 0) {
-                if (errno == EINTR) continue;
-                perror("epoll_wait threw an error");
+    /**
+     * @brief
+     * Makes the latest port set the one of the batch to come and tells the
+     * control path so
+     *
+     * @param worker
+     */
+    void enter_port_set(Worker& worker) {
+        PortSet* current;
+        do {
+            current = port_set.load();
+            worker.announced.store(current);
+        } while (current != port_set.load());
+        bool changed = current->version != worker.port_set_version;
+        if (changed && worker.flow_cache != nullptr) {
+            // ports came or went, decide every flow anew
+            worker.flow_cache->clear();
+        }
+        worker.port_set = current;
+        worker.port_set_version = current->version;
+        if (changed) {
+            arm_xdp_sockets(worker);
+        }
+    }
+
+    /**
+     * @brief
+     * Starts the AF_XDP sockets of worker on the ports that are new to it.
+     * Until then the XDP program passes their frames to the packet sockets,
+     * so none are lost and only the worker ever touches its umem (not thread safe)
+     *
+     * @param worker
+     */
+    void arm_xdp_sockets(Worker& worker) {
+        for (Ifentry* ifentry: worker.port_set->ports) {
+            if (ifentry == nullptr || ifentry->xdp == nullptr) {
+                continue;
+            }
+            PortSocket* socket = ifentry->sockets[worker.id];
+            if (socket->xdpSocket == nullptr || socket->xdp_armed) {
+                continue;
+            }
+            socket->xdp_armed = true;
+            socket->xdpSocket->refill();
+            worker.syscalls.add(1);
+            if (!ifentry->xdp->insert(worker.id, socket->xdpSocket->get_fd())) {
+                std::cerr << ifentry->ifname << ": ";
+                perror("Error adding the AF_XDP socket to the XSKMAP");
+            }
+        }
+    }
+
+    /**
+     * @brief open and set up one worker's socket on ifname (not thread safe)
+     * 
+     * @param ifname
+     * @return PortSocket*
+     */
+    PortSocket* open_port_socket(const std::string& ifname) {
+        RawSocket* rawSocket = new RawSocket(ifname, PROMISCIOUS, false);
+
+        // To read from dummy interfaces while testing, this needs to be disabled
+        rawSocket->set_ignore_outgoing(1);
+
+        // drop what the switch would drop before it is copied to user space
+        attach_filter(rawSocket, config.port(ifname));
+
+        // the vlan tag of received frames, for the acl
+        int auxdata = 1;
+        if (setsockopt(rawSocket->get_socket(), SOL_PACKET, PACKET_AUXDATA, &auxdata, sizeof(auxdata)) == -1) {
+            perror("Error enabling PACKET_AUXDATA");
+        }
+
+        enable_busy_poll(rawSocket->get_socket());
+
+        PortSocket* socket = new PortSocket(rawSocket, config.tx_queue_depth, config.tx_queue_policy);
+        if (!wants_xdp(ifname)) {
+            // otherwise once open_port_xdp() decided which sockets it takes
+            setup_port_io(socket, config.port(ifname));
+        }
+        return socket;
+    }
+
+    /**
+     * @brief
+     * Adds fd to a PACKET_FANOUT group. A group_id of 0 has the kernel pick an
+     * unused id for a new group and stores it in group_id.
+     *
+     * @param fd
+     * @param group_id
+     * @return boolean
+     */
+    bool join_fanout(int fd, int& group_id) {
+        int type = config.fanout_mode == FanoutMode::CPU ? PACKET_FANOUT_CPU : PACKET_FANOUT_HASH;
+        if (group_id == 0) {
+            type |= PACKET_FANOUT_FLAG_UNIQUEID;
+        }
+        int arg = group_id | type << 16;
+
+        if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == -1) {
+            perror("Error joining fanout group");
+            return false;
+        }
+
+        if (group_id == 0) {
+            socklen_t len = sizeof(arg);
+            if (getsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, &len) == -1) {
+                perror("Error reading fanout group");
+                return false;
+            }
+            group_id = arg & 0xFFFF;
+        }
+        return true;
+    }
+
+    /**
+     * @brief pick the rx/tx paths of a new socket, falling back to recv()/send() (not thread safe)
+     *
+     * @param socket
+     * @param port_config 
+     */
+    void setup_port_io(PortSocket* socket, const PortConfig& port_config) {
+        if (config.io_engine == IoEngine::IO_URING) {
+            socket->rx_mode = RxMode::URING;
+            socket->tx_mode = TxMode::URING;
+            return;
+        }
+
+        int fd = socket->rawSocket->get_socket();
+        bool rx_ring = port_config.rx_mode == RxMode::RING;
+        bool tx_ring = port_config.tx_mode == TxMode::RING;
+
+        if (rx_ring || tx_ring) {
+            try {
+                socket->packetRing = new PacketRing(fd, config.ring, rx_ring, tx_ring);
+                socket->rx_mode = rx_ring ? RxMode::RING : socket->rx_mode;
+                socket->tx_mode = tx_ring ? TxMode::RING : socket->tx_mode;
+            } catch (std::runtime_error& e) {
+                std::cerr << "Falling back to recv()/send() for " << socket->rawSocket->get_ifname() << ": " << e.what() << std::endl;
+            }
+        }
+
+        if (port_config.rx_mode == RxMode::BATCH || port_config.tx_mode == TxMode::BATCH) {
+            socket->batchIo = new BatchIo(fd, config.batch_size, packetPool);
+            socket->rx_mode = port_config.rx_mode == RxMode::BATCH ? RxMode::BATCH : socket->rx_mode;
+            socket->tx_mode = port_config.tx_mode == TxMode::BATCH ? TxMode::BATCH : socket->tx_mode;
+        }
+    }
+
+    /**
+     * @brief
+     * With poll_mode busy or adaptive, has the kernel busy poll the device
+     * queue fd receives from for up to busy_poll_us whenever the worker
+     * polls fd, preferred over the device interrupts (not thread safe)
+     *
+     * @param fd
+     */
+    void enable_busy_poll(int fd) {
+        if (config.poll_mode == PollMode::BLOCK || config.busy_poll_us == 0) {
+            return;
+        }
+        int usecs = config.busy_poll_us;
+        int prefer = 1;
+        int budget = config.batch_size;
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == -1) {
+            perror("Error enabling SO_BUSY_POLL");
+            return;
+        }
+        // 5.11, the budget is what AF_XDP sockets poll per recvfrom()/sendto()
+        if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1
+            || setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) == -1) {
+            perror("Error enabling SO_PREFER_BUSY_POLL");
+        }
+    }
+
+    /**
+     * @brief
+     * With poll_mode busy or adaptive, has epoll_wait() busy poll the device
+     * queues of the worker's ready sockets for busy_poll_us, without the
+     * net.core.busy_poll sysctl (control path)
+     */
+    void enable_epoll_busy_poll() {
+        if (config.poll_mode == PollMode::BLOCK || config.busy_poll_us == 0) {
+            return;
+        }
+        for (Worker* worker: workers) {
+            epoll_params params{};
+            params.busy_poll_usecs = config.busy_poll_us;
+            params.busy_poll_budget = std::min(config.batch_size, 64u); // more needs CAP_NET_ADMIN
+            params.prefer_busy_poll = 1;
+            if (ioctl(worker->ep, EPIOCSPARAMS, &params) == -1) {
+                // before 6.9, polling is left to the sockets and the sysctls
+                perror("Error setting epoll busy poll parameters");
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief true if ifname is configured for AF_XDP, which io_engine io_uring leaves out
+     *
+     * @param ifname
+     * @return boolean
+     */
+    bool wants_xdp(const std::string& ifname) {
+        return config.port(ifname).xdp != XdpMode::OFF && config.io_engine == IoEngine::EPOLL;
+    }
+
+    /**
+     * @brief
+     * Gives the sockets of ifentry AF_XDP sockets, one per rx queue on the
+     * worker with the queue's number, and attaches the XDP program feeding
+     * them. Leaves the port on its packet sockets if there are more queues
+     * than workers or the kernel or driver can't do it (control path).
+     *
+     * @param ifentry
+     */
+    void open_port_xdp(Ifentry* ifentry) {
+        const PortConfig& port_config = config.port(ifentry->ifname);
+        unsigned int queues = rx_queue_count(ifentry->ifname);
+        int ifindex = if_nametoindex(ifentry->ifname.c_str());
+
+        try {
+            if (queues == 0 || ifindex == 0) {
+                throw std::runtime_error("no rx queues found");
+            }
+            if (queues > workers.size()) {
+                // frames of a queue without a socket would bypass the fanout group
+                throw std::runtime_error(std::to_string(queues) + " rx queues for " + std::to_string(workers.size()) + " workers");
+            }
+            ifentry->xdp = new XdpProgram(ifindex, queues, port_config.xdp == XdpMode::GENERIC,
+                port_config.blocked_macs, port_config.blocked_ethertypes);
+            for (unsigned int queue = 0; queue < queues; queue++) {
+                Worker* worker = workers[queue];
+                if (worker->xdp_umem == nullptr) {
+                    worker->xdp_umem = new XdpUmem(config.xdp_frames, packetPool->get_frame_size());
+                }
+                ifentry->sockets[queue]->xdpSocket = new XdpSocket(ifindex, queue, worker->xdp_umem, !ifentry->xdp->is_generic());
+                enable_busy_poll(ifentry->sockets[queue]->xdpSocket->get_fd());
+            }
+        } catch (std::runtime_error& e) {
+            std::cerr << "Falling back to packet sockets for " << ifentry->ifname << ": " << e.what() << std::endl;
+            delete ifentry->xdp;
+            ifentry->xdp = nullptr;
+            for (PortSocket* socket: ifentry->sockets) {
+                delete socket->xdpSocket;
+                socket->xdpSocket = nullptr;
+            }
+            return;
+        }
+
+        for (unsigned int queue = 0; queue < queues; queue++) {
+            ifentry->sockets[queue]->rx_mode = RxMode::XDP;
+            ifentry->sockets[queue]->tx_mode = TxMode::XDP;
+        }
+        std::cerr << ifentry->ifname << ": AF_XDP on " << queues << " queues, "
+            << (ifentry->xdp->is_generic() ? "generic" : "native") << " mode, "
+            << (ifentry->sockets[0]->xdpSocket->is_zerocopy() ? "zero-copy" : "copy") << std::endl;
+    }
+
+    /**
+     * @brief number of rx queues of ifname, 0 if unknown
+     *
+     * @param ifname
+     * @return unsigned int
+     */
+    unsigned int rx_queue_count(const std::string& ifname) {
+        std::error_code error;
+        unsigned int queues = 0;
+        for (auto& entry: std::filesystem::directory_iterator("/sys/class/net/" + ifname + "/queues", error)) {
+            if (entry.path().filename().string().starts_with("rx-")) {
+                queues++;
+            }
+        }
+        return queues;
+    }
+
+    /**
+     * @brief
+     * Gives every worker its io_uring for io_engine io_uring, falling back
+     * to epoll for all of them if the kernel can't set one up (control path)
+     *
+     * @param frame_size largest frame a receive buffer has to hold
+     */
+    void open_urings(int frame_size) {
+        if (config.io_engine != IoEngine::IO_URING) {
+            return;
+        }
+        try {
+            for (Worker* worker: workers) {
+                worker->uring = new UringIo(URING_ENTRIES, config.uring_buffers, frame_size);
+            }
+        } catch (std::runtime_error& e) {
+            std::cerr << "Falling back to epoll: " << e.what() << std::endl;
+            for (Worker* worker: workers) {
+                delete worker->uring;
+                worker->uring = nullptr;
+            }
+            config.io_engine = IoEngine::EPOLL;
+        }
+    }
+
+    /**
+     * @brief
+     * Builds the socket filter for port_config and attaches it to rawSocket,
+     * replacing the previous one (control path)
+     *
+     * @param rawSocket
+     * @param port_config
+     */
+    void attach_filter(RawSocket* rawSocket, const PortConfig& port_config) {
+        SocketFilter filter(port_config.blocked_macs, port_config.blocked_ethertypes);
+        if (!filter.attach(rawSocket->get_socket())) {
+            std::cerr << rawSocket->get_ifname() << ": ";
+            perror("Error attaching the socket filter");
+        }
+    }
+
+    /**
+     * @brief adds the PACKET_STATISTICS since the last call, which the kernel resets on every read (control path)
+     *
+     * @param socket
+     */
+    void update_kernel_stats(PortSocket* socket) {
+        tpacket_stats stats{};
+        socklen_t length = sizeof(stats);
+        if (getsockopt(socket->rawSocket->get_socket(), SOL_PACKET, PACKET_STATISTICS, &stats, &length) == 0) {
+            // tp_packets includes the dropped frames
+            socket->kernel_packets += stats.tp_packets;
+            socket->kernel_drops += stats.tp_drops;
+        }
+
+        if (socket->xdpSocket != nullptr) {
+            // past the XDP program, received or dropped for want of room
+            uint64_t packets = socket->xdp_rx_frames.get();
+            uint64_t drops = socket->xdpSocket->get_dropped();
+            socket->kernel_packets += packets - socket->xdp_packets + drops - socket->xdp_drops;
+            socket->kernel_drops += drops - socket->xdp_drops;
+            socket->xdp_packets = packets;
+            socket->xdp_drops = drops;
+        }
+    }
+
+    /**
+     * @brief rx_packets of the interface, 0 if unknown
+     *
+     * @param ifname
+     * @return uint64_t
+     */
+    uint64_t interface_rx_packets(const std::string& ifname) {
+        std::ifstream file("/sys/class/net/" + ifname + "/statistics/rx_packets");
+        uint64_t rx_packets = 0;
+        file >> rx_packets;
+        return rx_packets;
+    }
+
+    /**
+     * @brief
+     * Frames the socket filters of ifentry dropped. cBPF keeps no counters,
+     * so this is what the interface received since the port was opened less
+     * what got past the filters, as of the last update_kernel_stats(). The
+     * fanout group shares the frames out, a socket left out of it sees every
+     * one of them again and only counts with what its AF_XDP socket got.
+     *
+     * @param ifentry
+     * @return uint64_t
+     */
+    uint64_t filtered_frames(Ifentry* ifentry) {
+        uint64_t passed = 0;
+        for (PortSocket* socket: ifentry->sockets) {
+            passed += socket->rx ? socket->kernel_packets : socket->xdp_packets + socket->xdp_drops;
+        }
+        uint64_t received = interface_rx_packets(ifentry->ifname) - ifentry->rx_packets_base;
+        return received > passed ? received - passed : 0;
+    }
+
+    /**
+     * @brief lowest port id not in use in ports, growing it if needed, -1 if all are taken (control path)
+     * 
+     * @param ports
+     * @return int 
+     */
+    int allocate_port_id(std::vector<Ifentry*>& ports) {
+        for (size_t i = 0; i < ports.size(); i++) {
+            // mac table entries learned on a retiring port are only gone once it is freed
+            if (ports[i] == nullptr && !retiring_port_id(i)) {
+                return i;
+            }
+        }
+        if (ports.size() >= MacTable::NO_PORT) {
+            return -1;
+        }
+        ports.push_back(nullptr);
+        return ports.size() - 1;
+    }
+
+    /**
+     * @brief register the socket of worker on ifentry for its epoll, events carry the epoll_tag (control path)
+     * 
+     * @param worker
+     * @param ifentry 
+     */
+    void register_socket_epoll(Worker& worker, Ifentry* ifentry) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+        int sockfd = socket->rawSocket->get_socket();
+        epoll_event ev{};
+        ev.events  = (socket->rx ? (uint32_t)EPOLLIN : 0u) | EPOLLET;
+        ev.data.u64 = epoll_tag(ifentry);
+
+        if (epoll_ctl(worker.ep, EPOLL_CTL_ADD, sockfd, &ev) == -1) {
+            perror("Error adding socket to epoll");
+            // Common cases: EEXIST (already added), EBADF/ENOENT (bad fd)
+            // TODO: HANDLE ERROR
+            return;
+        }
+
+        if (socket->xdpSocket != nullptr) {
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.u64 = epoll_tag(ifentry) | XDP_TAG;
+            if (epoll_ctl(worker.ep, EPOLL_CTL_ADD, socket->xdpSocket->get_fd(), &ev) == -1) {
+                perror("Error adding AF_XDP socket to epoll");
+            }
+        }
+    }
+
+    /**
+     * @brief take the socket of worker on ifentry out of its epoll set (not thread safe)
+     *
+     * @param worker
+     * @param ifentry
+     */
+    void unregister_socket_epoll(Worker& worker, Ifentry* ifentry) {
+        int sockfd = ifentry->sockets[worker.id]->rawSocket->get_socket();
+        worker.syscalls.add(1);
+        if (epoll_ctl(worker.ep, EPOLL_CTL_DEL, sockfd, nullptr) == -1 && errno != ENOENT) {
+            perror("Error removing socket from epoll");
+        }
+    }
+
+    /**
+     * @brief takes the port out of the port set, it is freed with its id once no worker can reach it any more (control path)
+     * 
+     * @param port_id 
+     */
+    void remove_port(uint16_t port_id) {
+        std::vector<Ifentry*> ports = port_set.load()->ports;
+        if (port_id < ports.size() && ports[port_id] != nullptr) {
+            Ifentry* ifentry = ports[port_id];
+            #ifndef NDEBUG
+            std::cerr << "Removing " << ifentry->ifname << std::endl;
+            #endif
+            ports[port_id] = nullptr;
+            namemap.erase(ifentry->ifname);
+            publish_port_set(ports, ifentry);
+            // stop switching to it now, whatever the workers still learn goes when it is freed
+            packetSwitch.removePort(port_id);
+        }
+    }
+
+    /**
+     * @brief stop switching to and from ifentry until the maintenance thread removes it
+     *
+     * @param ifentry
+     */
+    void fail_port(Ifentry* ifentry) {
+        ifentry->failed = true;
+    }
+
+    /**
+     * @brief arm or disarm EPOLLOUT for the socket of worker on ifentry, a no-op if it already is (not thread safe)
+     *
+     * @param worker
+     * @param ifentry
+     * @param has_output
+     */
+    void set_epollout(Worker& worker, Ifentry* ifentry, bool has_output) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+        if (socket->epollout == has_output) {
+            return;
+        }
+        // AF_XDP sockets send from their own tx ring
+        bool xdp = socket->tx_mode == TxMode::XDP;
+        int fd = xdp ? socket->xdpSocket->get_fd() : socket->rawSocket->get_socket();
+        epoll_event ev{};
+        ev.events = (socket->rx || xdp ? (uint32_t)EPOLLIN : 0u) | EPOLLET;
+        if (has_output) {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.u64 = epoll_tag(ifentry) | (xdp ? XDP_TAG : 0);
+    
+        // First try to modify (most common case)
+        worker.syscalls.add(1);
+        if (epoll_ctl(worker.ep, EPOLL_CTL_MOD, fd, &ev) == -1) {
+            if (errno == ENOENT) {
+                // fd not registered
+                // if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+                //     // TODO: HANDLE ERROR
+                // }
+                perror("Tried to set epollout for unregistered fd");
+            } else {
+                // TODO: HANDLE ERROR(S)
+                perror("Error setting epollout for fd");
+            }
+            return;
+        }
+        socket->epollout = has_output;
+    }
+
+    void device_manager_communication(std::string address) {
+        UnixWrapper unixWrapper(address, true, true);
+        LinkEventBatch batch;
+        while (1) {
+            int r = unixWrapper.receive_wrapper((char*)&batch, sizeof(batch), 0);
+
+            if (r < 0) {
+                perror("Error communicating with device manager");
+                continue;
+            }
+            else if (r == 0) {
+                std::cerr << "Device manager pipe closed unexpectedly." << std::endl;
                 break;
+            };
+
+            if (!batch.valid(r)) {
+                std::cerr << "Ignoring malformed or unsupported link event datagram (" << r << " bytes)" << std::endl;
+                continue;
+            }
+
+            for (uint16_t i = 0; i < batch.header.count; i++) {
+                handle_link_event(batch.events[i]);
+            }
+        }
+    }
+                
+    /**
+     * @brief
+     * Reads the pending link notifications and applies them, the first worker
+     * calls this between two batches when the link monitor is readable
+     */
+    void receive_link_events() {
+        while (true) {
+            int n = recv(link_monitor_fd, link_monitor_buffer.data(), link_monitor_buffer.size(), MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == ENOBUFS) {
+                    // the kernel dropped notifications, start over from the current state
+                    std::cerr << "Link notifications overran, resyncing" << std::endl;
+                    resync_links();
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("Error receiving link notifications");
+                }
+                return;
+            }
+            uint64_t received_ns = now_ns_monotonic();
+
+            for (nlmsghdr* nh = (nlmsghdr*)link_monitor_buffer.data(); NLMSG_OK(nh, (unsigned)n); nh = NLMSG_NEXT(nh, n)) {
+                LinkEvent event{};
+                if (parse_link_message(nh, event)) {
+                    event.received_ns = received_ns;
+                    handle_link_event(event);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief applies a fresh dump of all links and removes the ports whose link is gone
+     */
+    void resync_links() {
+        std::vector<LinkEvent> links;
+        if (!dump_links(links)) {
+            return;
+        }
+
+        LinkEvent marker{};
+        marker.type = static_cast<uint8_t>(LinkEventType::SYNC_BEGIN);
+        handle_link_event(marker);
+        for (auto& link: links) {
+            handle_link_event(link);
+        }
+        marker.type = static_cast<uint8_t>(LinkEventType::SYNC_END);
+        handle_link_event(marker);
+    }
+
+    /**
+     * @brief removes every port whose name is not in keep
+     *
+     * @param keep
+     */
+    void remove_ports_except(const std::unordered_set<std::string>& keep) {
+        std::vector<std::string> gone;
+        control_m.lock();
+        for (auto it=namemap.begin(); it!=namemap.end(); it++) {
+            if (!keep.contains(it->first)) {
+                gone.push_back(it->first);
+            }
+        }
+        control_m.unlock();
+        for (auto& ifname: gone) {
+            remove_device(ifname);
+        }
+    }
+
+    /**
+     * @brief applies one link event from the device manager or the link monitor
+     *
+     * @param event
+     */
+    void handle_link_event(const LinkEvent& event) {
+        if (event.type == (uint8_t)LinkEventType::SYNC_BEGIN) {
+            syncing = true;
+            synced_links.clear();
+            return;
+        }
+        if (event.type == (uint8_t)LinkEventType::SYNC_END) {
+            if (syncing) {
+                remove_ports_except(synced_links);
+            }
+            syncing = false;
+            return;
+        }
+
+        std::string ifname(event.ifname, strnlen(event.ifname, sizeof(event.ifname)));
+        if (ifname.empty()) {
+            return;
+        }
+
+        #ifndef NDEBUG
+        std::cerr << ifname << (event.type == (uint8_t)LinkEventType::NEW ? " NEW" : " DEL")
+            << " flags " << event.flags << " mtu " << event.mtu << " " << mac_to_str(event.mac) << std::endl;
+        #endif
+
+        if (event.type == (uint8_t)LinkEventType::NEW && (event.flags & LINK_LOWER_UP)) {
+            if (syncing) {
+                synced_links.insert(ifname);
+            }
+            int mtu = event.mtu == 0 ? 1500 : event.mtu;
+            update_device(
+                ifname, event.flags & LINK_LOOPBACK,
+                event.flags & LINK_BROADCAST, event.flags & LINK_MULTICAST,
+                mtu, pack_mac_bytes(event.mac));
+        }
+        else {
+            // down or deleted
+            remove_device(ifname);
+        }
+
+        // from reading the notification to the port set that has the change
+        uint64_t latency_ns = now_ns_monotonic() - event.received_ns;
+        link_events.add(1);
+        link_latency_last_ns.set(latency_ns);
+        if (latency_ns > link_latency_max_ns.get()) {
+            link_latency_max_ns.set(latency_ns);
+        }
+        #ifndef NDEBUG
+        std::cerr << ifname << " applied " << latency_ns / 1000 << " us after the link event" << std::endl;
+        #endif
+    }
+
+    /**
+     * @brief receive a single packet from the socket of worker on ifentry (not thread safe)
+     * 
+     * @param worker
+     * @param ifentry 
+     * @return boolean (Returns false if the socket is not readable or failed)
+     */
+    bool receive_packet(Worker& worker, Ifentry* ifentry) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+        int fd = socket->rawSocket->get_socket();
+        int frame_size = packetPool->get_frame_size();
+        Packet* packet = packetPool->allocate();
+
+        iovec iov{packet ? packet->data : worker.discard.data(), (size_t)frame_size};
+        alignas(cmsghdr) unsigned char control[AUXDATA_SPACE];
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        // MSG_TRUNC returns the real length so frames larger than a pool buffer can be told apart
+        int r = recvmsg(fd, &msg, MSG_TRUNC);
+        worker.syscalls.add(1);
+
+        if (r < 0) {
+            if (packet) {
+                packet->release();
+            }
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+                fail_port(ifentry);
+            }
+            return false;
+        }
+
+        socket->stats.rx_frames.add(1);
+        socket->stats.rx_batches.add(1);
+        worker.rx_frames.add(1);
+
+        if (packet == nullptr) {
+            // pool exhausted, the frame was read into the discard buffer to keep draining
+            return true;
+        }
+
+        if (r > frame_size) {
+            packet->release();
+            return true;
+        }
+
+        packet->size = r;
+        worker.rx_batch.push_back(RxFrame{packet->data, r, auxdata_vlan(&msg), packet});
+        forward_batch(worker, ifentry);
+
+        return true;
+    }
+
+    /**
+     * @brief receive up to batch_size packets from the socket of worker on ifentry with one recvmmsg() (not thread safe)
+     * 
+     * @param worker
+     * @param ifentry 
+     * @return boolean (Returns false once the socket is drained or failed)
+     */
+    bool receive_batch(Worker& worker, Ifentry* ifentry) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+
+        int r = socket->batchIo->receive_batch([&](Packet* packet, uint16_t vlan) {
+            worker.rx_batch.push_back(RxFrame{packet->data, packet->size, vlan, packet});
+        });
+        worker.syscalls.add(1);
+        forward_batch(worker, ifentry);
+
+        if (r < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) {
+                fail_port(ifentry);
+            }
+            return false;
+        }
+
+        socket->stats.rx_frames.add(r);
+        socket->stats.rx_batches.add(1);
+        worker.rx_frames.add(r);
+
+        // a short batch means the socket queue was empty
+        return r == (int)socket->batchIo->get_batch_size();
+    }
+
+    /**
+     * @brief switch every frame of the next ready rx ring block of the socket of worker on ifentry (not thread safe)
+     * 
+     * @param worker
+     * @param ifentry 
+     * @return boolean (Returns false if no block is ready) 
+     */
+    bool receive_ring(Worker& worker, Ifentry* ifentry) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+        int frames = 0;
+
+        // frames are forwarded in batch_size chunks, the last one before the block goes back to the kernel
+        bool received = socket->packetRing->receive_block([&](unsigned char* frame, int size, uint16_t vlan) {
+            worker.rx_batch.push_back(RxFrame{frame, size, vlan, nullptr});
+            if (worker.rx_batch.size() >= config.batch_size) {
+                forward_batch(worker, ifentry);
+            }
+            frames++;
+        }, [&]() {
+            forward_batch(worker, ifentry);
+        });
+
+        if (received) {
+            socket->stats.rx_frames.add(frames);
+            socket->stats.rx_batches.add(1);
+            worker.rx_frames.add(frames);
+        }
+
+        return received;
+    }
+
+    /**
+     * @brief switch up to batch_size frames from the AF_XDP socket of worker on ifentry in place (not thread safe)
+     *
+     * @param worker
+     * @param ifentry
+     * @return boolean (Returns false once the rx ring is drained)
+     */
+    bool receive_xdp(Worker& worker, Ifentry* ifentry) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+
+        unsigned int frames = socket->xdpSocket->receive_batch(config.batch_size, [&](unsigned char* frame, int size) {
+            worker.rx_batch.push_back(RxFrame{frame, size, NO_VLAN, nullptr});
+        }, [&]() {
+            forward_batch(worker, ifentry);
+        });
+        if (socket->xdpSocket->refill()) {
+            worker.syscalls.add(1);
+        }
+
+        if (frames > 0) {
+            socket->stats.rx_frames.add(frames);
+            socket->stats.rx_batches.add(1);
+            socket->xdp_rx_frames.add(frames);
+            worker.rx_frames.add(frames);
+        }
+
+        return frames == config.batch_size;
+    }
+
+    /**
+     * @brief switch the frames of worker.rx_batch, all received on src, and empty it (not thread safe)
+     * 
+     * Every receive path ends here. The headers of the batch are parsed
+     * together and the flow cache and mac table slots of all frames are
+     * prefetched before the first one is switched. The ingress acl is
+     * checked first, a denied frame is neither learned nor switched.
+     * 
+     * @param worker
+     * @param src ingress port
+     */
+    void forward_batch(Worker& worker, Ifentry* src) {
+        std::vector<RxFrame>& batch = worker.rx_batch;
+        if (batch.empty()) {
+            return;
+        }
+        worker.rx_headers.resize(batch.size());
+        worker.rx_keys.resize(batch.size());
+        worker.short_headers.resize(batch.size());
+
+        unsigned int count = 0;
+        for (RxFrame& frame: batch) {
+            if (frame.size < (int)sizeof(ether_header)) {
+                if (frame.owner) {
+                    frame.owner->release();
+                }
+                continue;
+            }
+            const unsigned char* header = frame.data;
+            if (frame.size < 16) {
+                // a ring frame this short may end the mapping
+                std::array<unsigned char, 16>& copy = worker.short_headers[count];
+                copy.fill(0);
+                memcpy(copy.data(), frame.data, frame.size);
+                header = copy.data();
+            }
+            worker.rx_headers[count] = header;
+            batch[count++] = frame;
+        }
+
+        const unsigned char* const* headers = worker.rx_headers.data();
+        FrameKeys* keys = worker.rx_keys.data();
+        classify_headers(headers, count, keys);
+        packetSwitch.prefetch(worker.flow_cache, src->port_id, headers, keys, count);
+
+        Acl* acl = worker.port_set->acl;
+        for (unsigned int i = 0; i < count; i++) {
+            RxFrame& frame = batch[i];
+            if (acl != nullptr && acl->evaluate(worker.id, src->port_id, frame.vlan, keys[i], frame.data, frame.size) == AclAction::DENY) {
+                if (frame.owner) {
+                    frame.owner->release();
+                }
+                continue;
+            }
+
+            int out_port = worker.flow_cache != nullptr
+                ? packetSwitch.switchCached(*worker.flow_cache, src->port_id, headers[i], keys[i], worker.now_ns)
+                : packetSwitch.switchKeys(src->port_id, keys[i], worker.now_ns);
+            output_frame(worker, src, frame.data, frame.size, frame.owner, out_port);
+        }
+        batch.clear();
+        transmit_pending(worker);
+
+        if (!worker.switched && count > 0) {
+            // startup timing, a worker flag keeps the shared one off the per batch path
+            worker.switched = true;
+            uint64_t none = 0;
+            first_switched_ns.compare_exchange_strong(none, now_ns_monotonic() - start_ns);
+        }
+    }
+
+    /**
+     * @brief queue a switched frame on its egress port(s) (not thread safe)
+     * 
+     * @param worker
+     * @param src ingress port
+     * @param frame 
+     * @param size 
+     * @param owner pool packet holding frame whose ownership passes on,
+     * nullptr if frame points into a rx ring and has to be copied
+     * @param out_port the switch's decision
+     */
+    void output_frame(Worker& worker, Ifentry* src, unsigned char* frame, int size, Packet* owner, int out_port) {
+        if (out_port == PacketSwitch::FLOOD) {
+            // UNICAST FLOODING
+            // every output buffer gets a reference to the same packet, copied at most once
+            Packet* shared = owner;
+            for (Ifentry* ifentry: worker.port_set->flood[src->port_id]) {
+                if (ifentry->failed) {
+                    continue;
+                }
+                if (queue_tx_ring(worker, ifentry, frame, size)) {
+                    continue;
+                }
+                if (shared == nullptr) {
+                    shared = copy_to_pool(frame, size);
+                    if (shared == nullptr) {
+                        continue;
+                    }
+                }
+                shared->retain();
+                queue_output(worker, ifentry, shared);
+            }
+            if (shared) {
+                shared->release();
+            }
+        } else if (out_port == PacketSwitch::DROP) {
+            if (owner) {
+                owner->release();
+            }
+        }
+        else if (out_port < (int)worker.port_set->ports.size() && worker.port_set->ports[out_port] != nullptr
+            && !worker.port_set->ports[out_port]->failed) {
+            enqueue_frame(worker, worker.port_set->ports[out_port], frame, size, owner);
+        }
+        else {
+            #ifndef NDEBUG
+            std::cerr << "Switching error to unknown port: " << out_port << std::endl;
+            #endif
+            if (owner) {
+                owner->release();
+            }
+        }
+    }
+    
+    /**
+     * @brief queue a frame for transmission on the socket of worker on ifentry (not thread safe)
+     * 
+     * Goes straight into the tx ring when the socket has one and nothing is
+     * waiting in front of it, otherwise into the output buffer, which is sent
+     * at the end of the rx batch.
+     * 
+     * @param worker
+     * @param ifentry 
+     * @param frame 
+     * @param size 
+     * @param owner pool packet holding frame whose reference passes on, nullptr to copy frame
+     */
+    void enqueue_frame(Worker& worker, Ifentry* ifentry, unsigned char* frame, int size, Packet* owner) {
+        if (queue_tx_ring(worker, ifentry, frame, size)) {
+            if (owner) {
+                owner->release();
             }
+            return;
+        }
 
-            m.lock();
-            for (int i = 0; i < n; ++i) {
-                int fd = events[i].data.fd;
-                uint32_t e = events[i].events;
-    
-                if (e & (EPOLLERR | EPOLLHUP)) {
-                    // Error or hangup: close and remove
-                    // (Kernel removes it from epoll automatically when fd is closed)
-                    remove_socket(fd);
+        if (owner == nullptr) {
+            owner = copy_to_pool(frame, size);
+            if (owner == nullptr) {
+                return; // pool exhausted, counted there
+            }
+        }
+        queue_output(worker, ifentry, owner);
+    }
+
+    /**
+     * @brief copy frame into the tx ring of the socket of worker on ifentry if it has one with room and an empty output buffer (not thread safe)
+     * 
+     * AF_XDP tx rings take frames received into the worker's umem without
+     * a copy. A frame too large for a PACKET_TX_RING slot is dropped and
+     * counted with the queue drops, in the output buffer it would block the
+     * port for good.
+     * 
+     * @param worker
+     * @param ifentry 
+     * @param frame 
+     * @param size 
+     * @return boolean (Returns false if the frame has to go through the output buffer) 
+     */
+    bool queue_tx_ring(Worker& worker, Ifentry* ifentry, unsigned char* frame, int size) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+        if (socket->tx_mode == TxMode::RING && (unsigned int)size > socket->packetRing->get_max_tx_frame()) {
+            socket->output_buffer.dropped.add(1);
+            return true;
+        }
+        if (!socket->output_buffer.empty() || !queue_ring_frame(socket, frame, size)) {
+            return false;
+        }
+
+        socket->stats.tx_frames.add(1);
+        worker.tx_frames.add(1);
+        if (!socket->tx_ring_dirty) {
+            socket->tx_ring_dirty = true;
+            worker.tx_ring_dirty_ports.push_back(ifentry->port_id);
+        }
+        return true;
+    }
+
+    /**
+     * @brief queue frame on the tx ring of socket, false if it has none or it is full (not thread safe)
+     *
+     * @param socket
+     * @param frame
+     * @param size
+     * @return boolean
+     */
+    bool queue_ring_frame(PortSocket* socket, const unsigned char* frame, int size) {
+        switch (socket->tx_mode) {
+            case TxMode::RING:
+                return socket->packetRing->queue_frame(frame, size);
+            case TxMode::XDP:
+                return socket->xdpSocket->queue_frame(frame, size);
+            default:
+                return false;
+        }
+    }
+
+    /**
+     * @brief append a packet reference to the output buffer of the socket of worker on ifentry,
+     * a full buffer drops by the tx_queue_policy (not thread safe)
+     * 
+     * A socket with EPOLLOUT armed is left to its EPOLLOUT event, others are
+     * sent to by transmit_pending() at the end of the rx batch.
+     * 
+     * @param worker
+     * @param ifentry 
+     * @param packet 
+     */
+    void queue_output(Worker& worker, Ifentry* ifentry, Packet* packet) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+        socket->output_buffer.push(packet);
+        if (!socket->epollout && !socket->tx_pending) {
+            socket->tx_pending = true;
+            worker.tx_pending_ports.push_back(ifentry->port_id);
+        }
+    }
+
+    /**
+     * @brief send the output buffers filled during the current rx batch right away (not thread safe)
+     *
+     * @param worker
+     */
+    void transmit_pending(Worker& worker) {
+        for (uint16_t port_id: worker.tx_pending_ports) {
+            Ifentry* ifentry = worker.port_set->ports[port_id];
+            if (ifentry == nullptr) {
+                continue;
+            }
+            ifentry->sockets[worker.id]->tx_pending = false;
+            if (!ifentry->failed) {
+                transmit_output_buffer(worker, ifentry);
+            }
+        }
+        worker.tx_pending_ports.clear();
+    }
+
+    Packet* copy_to_pool(unsigned char* frame, int size) {
+        Packet* packet = packetPool->allocate();
+        if (packet) {
+            memcpy(packet->data, frame, size);
+            packet->size = size;
+        }
+        return packet;
+    }
+
+    /**
+     * @brief hand the frames worker queued on tx rings during this batch to the kernel (not thread safe)
+     *
+     * Rings the kernel had no room for are flushed again next round. Until
+     * they are, their slots stay taken and EPOLLOUT never fires for them.
+     *
+     * @param worker
+     */
+    void flush_tx_rings(Worker& worker) {
+        for (uint64_t tag: worker.tx_ring_retry_ports) {
+            // a port id may have gone to another port since
+            Ifentry* ifentry = port_of_tag(worker, tag);
+            if (ifentry != nullptr && !ifentry->sockets[worker.id]->tx_ring_dirty) {
+                ifentry->sockets[worker.id]->tx_ring_dirty = true;
+                worker.tx_ring_dirty_ports.push_back(ifentry->port_id);
+            }
+        }
+        worker.tx_ring_retry_ports.clear();
+
+        for (uint16_t port_id: worker.tx_ring_dirty_ports) {
+            Ifentry* ifentry = worker.port_set->ports[port_id];
+            if (ifentry == nullptr) {
+                continue;
+            }
+            PortSocket* socket = ifentry->sockets[worker.id];
+            socket->tx_ring_dirty = false;
+            socket->stats.tx_batches.add(1);
+
+            int r;
+            if (socket->tx_mode == TxMode::XDP) {
+                unsigned int calls = 0;
+                r = socket->xdpSocket->flush(calls);
+                worker.syscalls.add(calls);
+                if (socket->xdpSocket->in_flight() > 0 && !socket->xdp_inflight) {
+                    socket->xdp_inflight = true;
+                    worker.xdp_inflight_ports.push_back(epoll_tag(ifentry));
+                }
+            }
+            else {
+                r = socket->packetRing->flush();
+                worker.syscalls.add(1);
+            }
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENOBUFS || errno == EBUSY)) {
+                worker.tx_ring_retry_ports.push_back(epoll_tag(ifentry));
+            }
+            else if (r < 0) {
+                perror("Error flushing tx ring");
+            }
+        }
+        worker.tx_ring_dirty_ports.clear();
+    }
+
+    /**
+     * @brief
+     * Frees the umem chunks of the AF_XDP sends the kernel completed since
+     * the last batch, so ports that stopped sending don't hold on to them (not thread safe)
+     *
+     * @param worker
+     */
+    void complete_xdp_sends(Worker& worker) {
+        std::vector<uint64_t>& tags = worker.xdp_inflight_ports;
+        for (size_t i = 0; i < tags.size();) {
+            // a port id may have gone to another port since, a removed port's chunks come back with its socket
+            Ifentry* ifentry = port_of_tag(worker, tags[i]);
+            PortSocket* socket = ifentry != nullptr ? ifentry->sockets[worker.id] : nullptr;
+            if (socket != nullptr && socket->xdpSocket != nullptr) {
+                socket->xdpSocket->complete();
+                if (socket->xdpSocket->in_flight() > 0) {
+                    i++;
                     continue;
                 }
-    
-                if (e & EPOLLIN) {
-                    while (receive_packet(fd)) {
+            }
+            if (socket != nullptr) {
+                socket->xdp_inflight = false;
+            }
+            tags[i] = tags.back();
+            tags.pop_back();
+        }
+    }
+
+    /**
+     * @brief send what is waiting in the output buffer of the socket of worker on ifentry (not thread safe)
+     * 
+     * Arms EPOLLOUT for whatever the socket did not take and disarms it once
+     * the buffer is empty. io_uring sockets have their sends submitted instead.
+     * 
+     * @param worker
+     * @param ifentry 
+     */
+    void transmit_output_buffer(Worker& worker, Ifentry* ifentry) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+
+        if (socket->tx_mode == TxMode::URING) {
+            submit_uring_sends(worker, ifentry);
+            return;
+        }
+
+        if (socket->tx_mode == TxMode::RING || socket->tx_mode == TxMode::XDP) {
+            // move what piled up while the ring was full back into it
+            while (!socket->output_buffer.empty()) {
+                Packet* packet = socket->output_buffer.front();
+                if (!queue_ring_frame(socket, packet->data, packet->size)) {
+                    break;
+                }
+                socket->output_buffer.pop();
+                packet->release();
+                socket->stats.tx_frames.add(1);
+                worker.tx_frames.add(1);
+
+                if (!socket->tx_ring_dirty) {
+                    socket->tx_ring_dirty = true;
+                    worker.tx_ring_dirty_ports.push_back(ifentry->port_id);
+                }
+            }
+        }
+        else if (socket->tx_mode == TxMode::BATCH) {
+            while (!socket->output_buffer.empty()) {
+                unsigned int count = std::min<size_t>(socket->output_buffer.size(), socket->batchIo->get_batch_size());
+                worker.tx_iovecs.resize(count);
+                for (unsigned int i = 0; i < count; i++) {
+                    worker.tx_iovecs[i].iov_base = socket->output_buffer.at(i)->data;
+                    worker.tx_iovecs[i].iov_len = socket->output_buffer.at(i)->size;
+                }
+
+                int r = socket->batchIo->send_batch(worker.tx_iovecs.data(), count);
+                worker.syscalls.add(1);
+
+                if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    fail_port(ifentry);
+                    return;
+                }
+                else if (r < 0) {
+                    break;
+                }
+
+                socket->stats.tx_frames.add(r);
+                socket->stats.tx_batches.add(1);
+                worker.tx_frames.add(r);
+
+                for (int i = 0; i < r; i++) {
+                    socket->output_buffer.front()->release();
+                    socket->output_buffer.pop();
+                }
+
+                if (r < (int)count) {
+                    break;
+                }
+            }
+        }
+        else {
+            while (!socket->output_buffer.empty()) {
+                Packet* packet = socket->output_buffer.front();
+                int r = socket->rawSocket->send_wrapper((const char*)packet->data, packet->size, 0);
+                worker.syscalls.add(1);
+
+                if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    fail_port(ifentry);
+                    return;
+                }
+                else if (r < 0) {
+                    break;
+                }
+                socket->output_buffer.pop();
+                packet->release();
+                socket->stats.tx_frames.add(1);
+                socket->stats.tx_batches.add(1);
+                worker.tx_frames.add(1);
+            }
+        }
+
+        set_epollout(worker, ifentry, !socket->output_buffer.empty());
+    }
+
+    /**
+     * @brief handle one epoll event of worker's current batch (not thread safe)
+     *
+     * @param worker
+     * @param event
+     */
+    void handle_event(Worker& worker, epoll_event& event) {
+        bool xdp = event.data.u64 & XDP_TAG;
+        uint64_t version = (event.data.u64 & ~XDP_TAG) >> 16;
+        uint16_t port_id = event.data.u64 & 0xFFFF;
+        uint32_t e = event.events;
+
+        if (version > worker.port_set->version) {
+            // the port was registered before its port set came out
+            worker.deferred.push_back(event);
+            return;
+        }
+
+        // the port may have been removed since, or its id handed to a newer port
+        std::vector<Ifentry*>& ports = worker.port_set->ports;
+        Ifentry* ifentry = port_id < ports.size() ? ports[port_id] : nullptr;
+        if (ifentry == nullptr || ifentry->version != version || ifentry->failed) {
+            return;
+        }
+
+        if (e & (EPOLLERR | EPOLLHUP)) {
+            // Error or hangup: the maintenance thread closes and removes it
+            // (Kernel removes it from epoll automatically when fd is closed)
+            fail_port(ifentry);
+            return;
+        }
+
+        if ((e & EPOLLIN) && xdp) {
+            while (receive_xdp(worker, ifentry)) {
+            }
+        }
+        else if (e & EPOLLIN) {
+            switch (ifentry->sockets[worker.id]->rx_mode) {
+                case RxMode::URING:
+                    // woke the worker for a new port, its multishot receive takes over from here
+                    unregister_socket_epoll(worker, ifentry);
+                    break;
+                case RxMode::RING:
+                    while (receive_ring(worker, ifentry)) {
                     }
+                    break;
+                case RxMode::BATCH:
+                    while (receive_batch(worker, ifentry)) {
+                    }
+                    break;
+                default:
+                    // RxMode::XDP too, for what the program passes before the socket is armed
+                    while (receive_packet(worker, ifentry)) {
+                    }
+                    break;
+            }
+        }
+
+        if ((e & EPOLLOUT) && !ifentry->failed) {
+            transmit_output_buffer(worker, ifentry);
+        }
+    }
+
+    /**
+     * @brief the port an epoll tag names if it is still in worker's port set and has not failed
+     *
+     * @param worker
+     * @param tag
+     * @return Ifentry* nullptr if the port is gone
+     */
+    Ifentry* port_of_tag(Worker& worker, uint64_t tag) {
+        uint64_t version = tag >> 16;
+        uint16_t port_id = tag & 0xFFFF;
+        std::vector<Ifentry*>& ports = worker.port_set->ports;
+        Ifentry* ifentry = port_id < ports.size() ? ports[port_id] : nullptr;
+        if (ifentry == nullptr || ifentry->version != version || ifentry->failed) {
+            return nullptr;
+        }
+        return ifentry;
+    }
+
+    /**
+     * @brief
+     * Arms a multishot receive on every socket of worker's port set that
+     * lacks one and cancels those of ports that are gone (not thread safe)
+     *
+     * @param worker
+     */
+    void arm_uring_receives(Worker& worker) {
+        worker.uring_rearm = false;
+        std::vector<uint64_t>& armed = worker.uring_armed;
+        for (size_t i = 0; i < armed.size(); ) {
+            if (port_of_tag(worker, armed[i]) == nullptr) {
+                worker.uring->cancel(UringIo::user_data(UringIo::RECV, armed[i]));
+                armed[i] = armed.back();
+                armed.pop_back();
+                continue;
+            }
+            i++;
+        }
+
+        for (Ifentry* ifentry: worker.port_set->ports) {
+            if (ifentry == nullptr || ifentry->loopback || ifentry->failed || !ifentry->sockets[worker.id]->rx) {
+                continue;
+            }
+            uint64_t tag = epoll_tag(ifentry);
+            if (std::find(armed.begin(), armed.end(), tag) != armed.end()) {
+                continue;
+            }
+            if (worker.uring->receive_multishot(ifentry->sockets[worker.id]->rawSocket->get_socket(), tag)) {
+                armed.push_back(tag);
+            }
+            else {
+                worker.uring_rearm = true; // submission queue full, next round
+            }
+        }
+    }
+
+    /**
+     * @brief
+     * Submits sends for the output buffer of the socket of worker on
+     * ifentry, at most batch_size in flight per socket (not thread safe)
+     *
+     * @param worker
+     * @param ifentry
+     */
+    void submit_uring_sends(Worker& worker, Ifentry* ifentry) {
+        PortSocket* socket = ifentry->sockets[worker.id];
+        int fd = socket->rawSocket->get_socket();
+        bool submitted = false;
+        while (!socket->output_buffer.empty() && socket->tx_inflight < config.batch_size) {
+            if (worker.uring_free_sends.empty()) {
+                worker.uring_free_sends.push_back(worker.uring_sends.size());
+                worker.uring_sends.push_back(UringSend{nullptr, 0});
+            }
+            uint32_t slot = worker.uring_free_sends.back();
+            Packet* packet = socket->output_buffer.front();
+            if (!worker.uring->send(fd, packet->data, packet->size, slot)) {
+                break;
+            }
+            worker.uring_free_sends.pop_back();
+            worker.uring_sends[slot] = UringSend{packet, epoll_tag(ifentry)};
+            socket->output_buffer.pop();
+            socket->tx_inflight++;
+            submitted = true;
+        }
+        if (submitted) {
+            socket->stats.tx_batches.add(1);
+        }
+    }
+
+    /**
+     * @brief
+     * A send completed: counts it, frees its packet and sends more of the
+     * output buffer it came from at the end of the round (not thread safe)
+     *
+     * @param worker
+     * @param cqe
+     */
+    void complete_uring_send(Worker& worker, const io_uring_cqe& cqe) {
+        uint32_t slot = UringIo::tag_of(cqe);
+        UringSend send = worker.uring_sends[slot];
+        worker.uring_free_sends.push_back(slot);
+        send.packet->release();
+
+        Ifentry* ifentry = port_of_tag(worker, send.port_tag);
+        if (ifentry == nullptr) {
+            return;
+        }
+        PortSocket* socket = ifentry->sockets[worker.id];
+        socket->tx_inflight--;
+        if (cqe.res >= 0) {
+            socket->stats.tx_frames.add(1);
+            worker.tx_frames.add(1);
+        }
+        else if (cqe.res == -ENOBUFS) {
+            socket->output_buffer.dropped.add(1); // the device queue was full, counted like a queue drop
+        }
+        else {
+            fail_port(ifentry);
+            return;
+        }
+        if (!socket->output_buffer.empty() && !socket->tx_pending) {
+            socket->tx_pending = true;
+            worker.tx_pending_ports.push_back(ifentry->port_id);
+        }
+    }
+
+    /**
+     * @brief
+     * A multishot receive delivered a frame or ended. Frames of one port are
+     * collected in rx_batch until another port's frame, batch_size frames or
+     * the end of the round forwards them (not thread safe)
+     *
+     * @param worker
+     * @param cqe
+     * @param rx_port port of the frames in rx_batch
+     */
+    void complete_uring_receive(Worker& worker, const io_uring_cqe& cqe, Ifentry*& rx_port) {
+        uint64_t tag = UringIo::tag_of(cqe);
+        Ifentry* ifentry = port_of_tag(worker, tag);
+
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            std::vector<uint64_t>& armed = worker.uring_armed;
+            auto it = std::find(armed.begin(), armed.end(), tag);
+            if (it != armed.end()) {
+                armed.erase(it);
+            }
+            if (ifentry != nullptr) {
+                if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+                    fail_port(ifentry);
                 }
-                
-                if (e & EPOLLOUT) {
-                    if (fdmap.contains(fd)){
-                        Ifentry* ifentry = fdmap.at(fd);
-                        while (!ifentry->output_buffer.empty()) {
-                            Packet* packet = ifentry->output_buffer.front();
-                            int r = ifentry->rawSocket->send_wrapper((const char*)packet->data, packet->size, 0);
-
-                            if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
-                                delete packet;
-                                remove_socket(fd);
-                                break;
-                            }
-                            else if (r < 0) {
-                                break;
-                            }
-                            ifentry->output_buffer.pop();
-                            delete packet;
-                        }
+                else {
+                    worker.uring_rearm = true; // out of buffers until this round's are recycled
+                }
+            }
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+            return;
+        }
+        uint16_t buffer = UringIo::buffer_id(cqe);
+        unsigned char* frame;
+        int size;
+        uint16_t vlan;
+        if (ifentry == nullptr || ifentry->failed || cqe.res < 0 || !worker.uring->frame_of(cqe, frame, size, vlan)) {
+            worker.uring->recycle(buffer);
+            return;
+        }
+
+        if (ifentry != rx_port || worker.rx_batch.size() >= config.batch_size) {
+            forward_uring_batch(worker, rx_port);
+            rx_port = ifentry;
+        }
+        worker.rx_batch.push_back(RxFrame{frame, size, vlan, nullptr});
+        worker.uring_rx_buffers.push_back(buffer);
+
+        PortSocket* socket = ifentry->sockets[worker.id];
+        socket->stats.rx_frames.add(1);
+        worker.rx_frames.add(1);
+    }
+
+    /**
+     * @brief forwards rx_batch, received on src, and recycles its receive buffers (not thread safe)
+     *
+     * @param worker
+     * @param src nullptr if the batch is empty
+     */
+    void forward_uring_batch(Worker& worker, Ifentry* src) {
+        if (src == nullptr || worker.rx_batch.empty()) {
+            return;
+        }
+        src->sockets[worker.id]->stats.rx_batches.add(1);
+        forward_batch(worker, src);
+        for (uint16_t buffer: worker.uring_rx_buffers) {
+            worker.uring->recycle(buffer);
+        }
+        worker.uring_rx_buffers.clear();
+    }
+
+    /**
+     * @brief
+     * packet_processor() on the worker's io_uring. One io_uring_enter()
+     * submits the sends of the last round and sleeps until completions
+     * arrive. The worker's epoll set is polled through the ring as well,
+     * for the link monitor and for the first frame of a port whose port set
+     * the worker has not entered yet. Polling, it only enters the kernel
+     * for submissions or completions that wait on it.
+     *
+     * @param worker
+     */
+    void uring_processor(Worker& worker) {
+        UringIo* uring = worker.uring;
+        std::vector<epoll_event> events(256);
+        std::vector<epoll_event> retry;
+
+        uring->poll_multishot(worker.ep, 0);
+        enter_port_set(worker);
+        arm_uring_receives(worker);
+
+        while (true) {
+            worker.announced.store(nullptr);
+
+            // come back soon for deferred events, their port set is on its way,
+            // and only collect what completed while polling
+            bool spin = polling(worker);
+            if (!spin || uring->needs_enter()) {
+                int r = uring->submit_and_wait(spin ? 0 : 1, worker.deferred.empty() ? -1 : 1);
+                worker.syscalls.add(1);
+                if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) {
+                    perror("io_uring_enter threw an error");
+                    break;
+                }
+            }
+
+            if (spin && !uring->has_completions()) {
+                worker.now_ns = now_ns_monotonic();
+                if (worker.deferred.empty()) {
+                    sched_yield();
+                    continue;
+                }
+            }
+
+            uint64_t previous = worker.port_set_version;
+            enter_port_set(worker);
+            worker.now_ns = now_ns_monotonic();
+            if (uring->has_completions()) {
+                worker.last_event_ns = worker.now_ns;
+            }
+            packetSwitch.age(worker.now_ns);
 
-                        if (ifentry->output_buffer.empty()) {
-                            set_epollout(ifentry->rawSocket->get_socket(), false);
+            retry.swap(worker.deferred);
+            for (auto& event: retry) {
+                handle_event(worker, event);
+            }
+            retry.clear();
+
+            bool epoll_ready = false;
+            Ifentry* rx_port = nullptr;
+            uring->for_each_completion([&](const io_uring_cqe& cqe) {
+                switch (UringIo::op_of(cqe)) {
+                    case UringIo::RECV:
+                        complete_uring_receive(worker, cqe, rx_port);
+                        break;
+                    case UringIo::SEND:
+                        complete_uring_send(worker, cqe);
+                        break;
+                    case UringIo::POLL:
+                        epoll_ready = true;
+                        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                            uring->poll_multishot(worker.ep, 0);
                         }
+                        break;
+                    default:
+                        break;
+                }
+            });
+            forward_uring_batch(worker, rx_port);
+            transmit_pending(worker);
+
+            bool link_events = false;
+            if (epoll_ready) {
+                int n = epoll_wait(worker.ep, events.data(), static_cast<int>(events.size()), 0);
+                worker.syscalls.add(1);
+                for (int i = 0; i < n; ++i) {
+                    if (events[i].data.u64 == LINK_MONITOR_TAG) {
+                        link_events = true;
+                        continue;
                     }
+                    handle_event(worker, events[i]);
+                }
+            }
+
+            if (worker.port_set_version != previous || worker.uring_rearm) {
+                arm_uring_receives(worker);
+            }
+
+            if (link_events) {
+                // out of the batch, so a port set it replaces can be freed right away
+                worker.announced.store(nullptr);
+                receive_link_events();
+            }
+        }
+    }
+
+    /**
+     * @brief
+     * Whether worker polls without sleeping in its next wait: always with
+     * poll_mode busy, with adaptive until poll_budget_us pass without events
+     *
+     * @param worker
+     * @return boolean
+     */
+    bool polling(Worker& worker) {
+        switch (config.poll_mode) {
+            case PollMode::BUSY:
+                return true;
+            case PollMode::ADAPTIVE:
+                return worker.now_ns - worker.last_event_ns < (uint64_t)config.poll_budget_us * 1000;
+            default:
+                return false;
+        }
+    }
+
+    void packet_processor(Worker& worker) {
+        if (worker.uring != nullptr) {
+            uring_processor(worker);
+            return;
+        }
+
+        std::vector<epoll_event> events(256);
+        std::vector<epoll_event> retry;
+
+        while (true) {
+            worker.announced.store(nullptr);
+
+            // come back soon for deferred events, their port set is on its way,
+            // and for tx rings the kernel had no room for
+            bool spin = polling(worker);
+            bool idle = worker.deferred.empty() && worker.tx_ring_retry_ports.empty();
+            int timeout = spin ? 0 : idle ? -1 : 1;
+            int n = epoll_wait(worker.ep, events.data(), static_cast<int>(events.size()), timeout);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait threw an error");
+                break;
+            }
+            worker.syscalls.add(1);
+
+            if (n == 0 && spin) {
+                worker.now_ns = now_ns_monotonic();
+                if (idle) {
+                    // nothing to do, and aging takes a lock the other workers learn under;
+                    // let whatever shares the cpu run, such as the softirq delivering the next frame
+                    sched_yield();
+                    continue;
+                }
+            }
+
+            enter_port_set(worker);
+            worker.now_ns = now_ns_monotonic();
+            if (n > 0) {
+                worker.last_event_ns = worker.now_ns;
+            }
+            packetSwitch.age(worker.now_ns);
+
+            retry.swap(worker.deferred);
+            for (auto& event: retry) {
+                handle_event(worker, event);
+            }
+            retry.clear();
+            complete_xdp_sends(worker);
+
+            bool link_events = false;
+            for (int i = 0; i < n; ++i) {
+                if (events[i].data.u64 == LINK_MONITOR_TAG) {
+                    link_events = true;
+                    continue;
                 }
+                handle_event(worker, events[i]);
+            }
+            flush_tx_rings(worker);
+
+            if (link_events) {
+                // out of the batch, so a port set it replaces can be freed right away
+                worker.announced.store(nullptr);
+                receive_link_events();
             }
-            m.unlock();
     
             // Grow event array if we hit capacity
             if (n == static_cast<int>(events.size())) {
@@ -495,16 +2630,48 @@ class PacketHandler {
         }
     }
 
+    ForwarderConfig config;
     PacketSwitch packetSwitch;
+    PacketPool* packetPool;
+
+    std::vector<Worker*> workers;
+    uint64_t last_stats_ns;
+
+    // startup timing from the constructor on, printed with the stats
+    uint64_t start_ns;
+    size_t discovered_devices = 0;
+    uint64_t discovered_ns = 0;
+    uint64_t ports_ready_ns = 0;
+    std::atomic<uint64_t> first_switched_ns{0}; // 0 until a worker switched a frame
+
+    // rtnetlink link notifications read by the first worker, -1 when the device manager sends them
+    int link_monitor_fd = -1;
+    std::vector<char> link_monitor_buffer = std::vector<char>(1 << 16);
 
-    // ifname, ifentry*
+    // written by whichever thread applies link events, device manager thread or first worker
+    Counter link_events;
+    Counter link_latency_last_ns;
+    Counter link_latency_max_ns;
+
+    // links that are up since the last SYNC_BEGIN (link event thread only)
+    std::unordered_set<std::string> synced_links;
+    bool syncing = false;
+
+    // ifname, ifentry* (control path only)
     std::unordered_map<std::string, Ifentry*> namemap;
     
-    // fd, RawSocket*
-    std::unordered_map<int, Ifentry*> fdmap;
-
-    int ep;
-    std::mutex m;
+    // latest port set, replaced by the control path and read by the workers
+    std::atomic<PortSet*> port_set;
+
+    // replaced port sets the workers may still read, oldest first (control path only)
+    std::vector<RetiredPortSet> retired_port_sets;
+    // wakes the maintenance thread to free them
+    std::condition_variable reclaim_cv;
+    // devices to add once the removed port on their ifname is freed (control path only)
+    std::unordered_map<std::string, DeviceInfo> pending_devices;
+
+    // serializes the control path: device updates, removals, reloads and dumps
+    std::mutex control_m;
 };
 
 #endif
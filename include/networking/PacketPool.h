@@ -0,0 +1,215 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+
+class PacketPool;
+
+/**
+ * @brief
+ * Reference counted frame buffer handed out by PacketPool. The struct sits at
+ * the start of its pool buffer with the frame data right behind it, so a
+ * Packet costs a single pool allocation and nothing on the heap.
+ *
+ * A flooded frame is one Packet holding a reference per egress queue, the
+ * data must not be modified once it is shared.
+ */
+struct Packet {
+    unsigned char* data;
+    int size;
+    PacketPool* pool;
+    std::atomic<int> refs;
+
+    void retain() {
+        refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief
+     * Drops one reference, the last one hands the buffer back to its pool
+     */
+    void release();
+};
+
+struct PoolStats {
+    uint64_t buffers;
+    uint64_t in_use;
+    uint64_t high_water;
+    uint64_t exhausted; // allocations that found the pool empty
+};
+
+/**
+ * @brief
+ * Preallocated pool of fixed size frame buffers. Every thread keeps a small
+ * cache of free buffers and only takes the pool lock to move CACHE_BATCH
+ * buffers at a time between its cache and the shared free list.
+ */
+class PacketPool {
+    public:
+    /**
+     * @brief
+     *
+     * @param frame_size largest frame (ethernet header included) a buffer holds
+     * @param buffer_count
+     */
+    PacketPool(int frame_size, unsigned int buffer_count) {
+        this->frame_size = frame_size;
+        this->buffer_count = buffer_count;
+        buffer_size = (HEADROOM + frame_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+
+        slab = (unsigned char*)std::aligned_alloc(CACHE_LINE, buffer_size * buffer_count);
+        if (slab == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        free_list.reserve(buffer_count);
+        for (size_t i = buffer_count; i > 0; i--) {
+            free_list.push_back(slab + (i - 1) * buffer_size);
+        }
+    }
+
+    int get_frame_size() {
+        return frame_size;
+    }
+
+    /**
+     * @brief
+     *
+     * @return Packet* with size 0 and one reference, nullptr if the pool is exhausted
+     */
+    Packet* allocate() {
+        LocalCache& cache = local_cache();
+
+        if (cache.pool != this) {
+            cache.flush();
+            cache.pool = this;
+        }
+
+        if (cache.buffers.empty()) {
+            m.lock();
+            size_t take = std::min<size_t>(CACHE_BATCH, free_list.size());
+            cache.buffers.insert(cache.buffers.end(), free_list.end() - take, free_list.end());
+            free_list.resize(free_list.size() - take);
+            m.unlock();
+
+            if (cache.buffers.empty()) {
+                exhausted.fetch_add(1, std::memory_order_relaxed);
+                return nullptr;
+            }
+        }
+
+        unsigned char* buffer = cache.buffers.back();
+        cache.buffers.pop_back();
+
+        uint64_t used = in_use.fetch_add(1, std::memory_order_relaxed) + 1;
+        uint64_t high = high_water.load(std::memory_order_relaxed);
+        while (used > high && !high_water.compare_exchange_weak(high, used, std::memory_order_relaxed)) {
+        }
+
+        Packet* packet = new (buffer) Packet();
+        packet->data = buffer + HEADROOM;
+        packet->size = 0;
+        packet->pool = this;
+        packet->refs.store(1, std::memory_order_relaxed);
+        return packet;
+    }
+
+    /**
+     * @brief
+     * Returns the buffer regardless of outstanding references, use Packet::release()
+     *
+     * @param packet
+     */
+    void release(Packet* packet) {
+        LocalCache& cache = local_cache();
+
+        if (cache.pool != this) {
+            cache.flush();
+            cache.pool = this;
+        }
+
+        in_use.fetch_sub(1, std::memory_order_relaxed);
+        cache.buffers.push_back((unsigned char*)packet);
+
+        if (cache.buffers.size() >= 2 * CACHE_BATCH) {
+            give_back(cache.buffers, CACHE_BATCH);
+        }
+    }
+
+    PoolStats get_stats() {
+        return PoolStats{
+            buffer_count,
+            in_use.load(std::memory_order_relaxed),
+            high_water.load(std::memory_order_relaxed),
+            exhausted.load(std::memory_order_relaxed)
+        };
+    }
+
+    ~PacketPool() {
+        // caches of other threads went back to the pool when they exited
+        LocalCache& cache = local_cache();
+        if (cache.pool == this) {
+            cache.buffers.clear();
+            cache.pool = nullptr;
+        }
+        std::free(slab);
+    }
+
+    private:
+    static constexpr size_t CACHE_LINE = 64;
+    static constexpr size_t HEADROOM = (sizeof(Packet) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    static constexpr size_t CACHE_BATCH = 32;
+
+    struct LocalCache {
+        PacketPool* pool = nullptr;
+        std::vector<unsigned char*> buffers;
+
+        void flush() {
+            if (pool) {
+                pool->give_back(buffers, buffers.size());
+            }
+        }
+
+        ~LocalCache() {
+            flush();
+        }
+    };
+
+    static LocalCache& local_cache() {
+        static thread_local LocalCache cache;
+        return cache;
+    }
+
+    void give_back(std::vector<unsigned char*>& buffers, size_t count) {
+        m.lock();
+        free_list.insert(free_list.end(), buffers.end() - count, buffers.end());
+        m.unlock();
+        buffers.resize(buffers.size() - count);
+    }
+
+    int frame_size;
+    uint64_t buffer_count;
+    size_t buffer_size;
+    unsigned char* slab;
+
+    std::mutex m;
+    std::vector<unsigned char*> free_list;
+
+    std::atomic<uint64_t> in_use{0};
+    std::atomic<uint64_t> high_water{0};
+    std::atomic<uint64_t> exhausted{0};
+};
+
+inline void Packet::release() {
+    if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        pool->release(this);
+    }
+}
+
+#endif
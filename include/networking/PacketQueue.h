@@ -0,0 +1,136 @@
+#ifndef PACKET_QUEUE_H
+#define PACKET_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "Counter.h"
+#include "PacketPool.h"
+
+enum class DropPolicy {
+    TAIL, // a full queue refuses the new packet
+    HEAD  // a full queue drops its oldest packet to make room
+};
+
+/**
+ * @brief
+ * Fixed capacity ring of packet references, used as the egress queue of a
+ * port. Lock free for one producer and one consumer thread. HEAD drop pops
+ * from the producer side, so it is only safe when producer and consumer are
+ * the same thread, as they are for a worker's own sockets.
+ *
+ * Holds one reference per queued packet and releases what is left on
+ * destruction.
+ */
+class PacketQueue {
+    public:
+    /**
+     * @brief
+     *
+     * @param capacity rounded up to a power of two
+     * @param policy
+     */
+    PacketQueue(unsigned int capacity, DropPolicy policy = DropPolicy::TAIL) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots = new Packet*[size];
+        mask = size - 1;
+        this->policy = policy;
+    }
+
+    PacketQueue(const PacketQueue&) = delete;
+    PacketQueue& operator=(const PacketQueue&) = delete;
+
+    ~PacketQueue() {
+        while (!empty()) {
+            front()->release();
+            pop();
+        }
+        delete[] slots;
+    }
+
+    /**
+     * @brief
+     * Takes over the reference to packet. When the queue is full either
+     * packet or the oldest queued packet is released, depending on the policy.
+     *
+     * @param packet
+     * @return boolean (Returns false if packet was dropped)
+     */
+    bool push(Packet* packet) {
+        size_t t = tail.load(std::memory_order_relaxed);
+
+        if (t - head.load(std::memory_order_acquire) > mask) {
+            dropped.add(1);
+            if (policy == DropPolicy::TAIL) {
+                packet->release();
+                return false;
+            }
+            front()->release();
+            pop();
+        }
+
+        slots[t & mask] = packet;
+        tail.store(t + 1, std::memory_order_release);
+
+        enqueued.add(1);
+        size_t depth = t + 1 - head.load(std::memory_order_relaxed);
+        if (depth > high_water.get()) {
+            high_water.set(depth);
+        }
+        return true;
+    }
+
+    Packet* front() {
+        return at(0);
+    }
+
+    /**
+     * @brief
+     *
+     * @param i position from the front, less than size()
+     * @return Packet*
+     */
+    Packet* at(size_t i) {
+        return slots[(head.load(std::memory_order_relaxed) + i) & mask];
+    }
+
+    /**
+     * @brief
+     * Removes the front packet without releasing it
+     */
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    size_t size() {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+
+    bool empty() {
+        return size() == 0;
+    }
+
+    size_t capacity() {
+        return mask + 1;
+    }
+
+    // written by the producer
+    Counter enqueued;
+    Counter dropped;
+    Counter high_water;
+
+    private:
+    Packet** slots;
+    size_t mask;
+    DropPolicy policy;
+
+    // free running positions, the producer owns tail and the consumer head
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+#endif
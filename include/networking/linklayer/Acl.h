@@ -0,0 +1,383 @@
+#ifndef ACL_H
+#define ACL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <net/ethernet.h>
+
+#include "mac_utils.h"
+#include "HeaderClassifier.h"
+#include "../Counter.h"
+
+enum class AclAction {
+    PERMIT,
+    DENY
+};
+
+/**
+ * @brief
+ * One ingress rule, a config line of the form
+ *
+ *     acl <ifname|any> <permit|deny> [src <mac>] [dst <mac>] [ethertype <hex>] [vlan <id>]
+ *
+ * Fields left out match anything. A vlan rule only matches frames that
+ * arrived with an 802.1Q (or 802.1ad) tag of that id, ethertype is the one
+ * after the tag.
+ */
+struct AclRule {
+    enum Fields : uint8_t {
+        SRC = 1 << 0,
+        DST = 1 << 1,
+        ETHERTYPE = 1 << 2,
+        VLAN = 1 << 3,
+        PORT = 1 << 4
+    };
+
+    std::string text; // the config line, names the rule in the stats
+    std::string ifname; // empty for any port
+    AclAction action = AclAction::PERMIT;
+    uint8_t fields = 0;
+    uint64_t src = 0;
+    uint64_t dst = 0;
+    uint16_t ethertype = 0;
+    uint16_t vlan = 0;
+
+    /**
+     * @brief
+     * Throws std::invalid_argument on a malformed rule
+     *
+     * @param tokens the config line split on whitespace, starting with "acl"
+     * @return AclRule
+     */
+    static AclRule parse(const std::vector<std::string>& tokens) {
+        if (tokens.size() < 3 || tokens.size() % 2 == 0) {
+            throw std::invalid_argument("expected acl <ifname|any> <permit|deny> [<field> <value>]...");
+        }
+
+        AclRule rule;
+        for (size_t i = 0; i < tokens.size(); i++) {
+            rule.text += (i ? " " : "") + tokens[i];
+        }
+
+        if (tokens[1] != "any") {
+            rule.ifname = tokens[1];
+            rule.fields |= PORT;
+        }
+
+        if (tokens[2] == "permit") {
+            rule.action = AclAction::PERMIT;
+        }
+        else if (tokens[2] == "deny") {
+            rule.action = AclAction::DENY;
+        }
+        else {
+            throw std::invalid_argument("acl action must be permit or deny");
+        }
+
+        for (size_t i = 3; i < tokens.size(); i += 2) {
+            const std::string& key = tokens[i];
+            const std::string& value = tokens[i + 1];
+            uint8_t field;
+            if (key == "src") {
+                rule.src = pack_mac_bytes(mac_str_to_bytes(value).data());
+                field = SRC;
+            }
+            else if (key == "dst") {
+                rule.dst = pack_mac_bytes(mac_str_to_bytes(value).data());
+                field = DST;
+            }
+            else if (key == "ethertype") {
+                rule.ethertype = parse_number(value, 16, 0xFFFF, "acl ethertype must be hex, at most 0xffff");
+                field = ETHERTYPE;
+            }
+            else if (key == "vlan") {
+                rule.vlan = parse_number(value, 10, 4095, "acl vlan must be 0-4095");
+                field = VLAN;
+            }
+            else {
+                throw std::invalid_argument("unknown acl field " + key);
+            }
+            if (rule.fields & field) {
+                throw std::invalid_argument("acl field " + key + " given twice");
+            }
+            rule.fields |= field;
+        }
+        return rule;
+    }
+
+    private:
+    static uint16_t parse_number(const std::string& value, int base, unsigned long max, const std::string& error) {
+        unsigned long number;
+        size_t end;
+        try {
+            number = std::stoul(value, &end, base);
+        } catch (std::exception&) {
+            throw std::invalid_argument(error);
+        }
+        if (end != value.size() || number > max) {
+            throw std::invalid_argument(error);
+        }
+        return number;
+    }
+};
+
+/**
+ * @brief
+ * Rule set compiled for one port set, read by the workers without locking.
+ *
+ * Tuple space search: rules are grouped by which fields they match on, and
+ * every group is a flat hash table of the masked field values to the first
+ * rule with them. A lookup masks the frame once per group and probes, so
+ * its cost grows with the number of distinct field combinations (at most
+ * 32) instead of the number of rules. Groups are probed in order of their
+ * first rule and the search stops once no later group can hold an earlier
+ * match, so the first matching rule in config order wins. Frames no rule
+ * matches are permitted.
+ *
+ * Hit counters are per worker and rule, each written by its worker only.
+ */
+class Acl {
+    public:
+    static constexpr uint32_t NO_RULE = 0xFFFFFFFF;
+
+    /**
+     * @brief
+     *
+     * @param rules in config order
+     * @param port_ids ifname -> port id of the ports to compile for, rules naming other ports are left out
+     * @param workers
+     */
+    Acl(const std::vector<AclRule>& rules, const std::unordered_map<std::string, uint16_t>& port_ids, unsigned int workers) {
+        this->rules = rules;
+        this->workers = workers;
+        hits = new Counter[std::max<size_t>(rules.size() * workers, 1)];
+
+        // first pass sizes the groups, a second one fills them
+        std::vector<std::vector<uint32_t>> members(32);
+        std::vector<Key> keys(rules.size());
+        for (uint32_t i = 0; i < rules.size(); i++) {
+            const AclRule& rule = rules[i];
+            uint16_t port = 0;
+            if (rule.fields & AclRule::PORT) {
+                auto it = port_ids.find(rule.ifname);
+                if (it == port_ids.end()) {
+                    continue;
+                }
+                port = it->second;
+            }
+            keys[i] = Key{rule.dst, rule.src, pack_rest(rule.ethertype, rule.vlan, port)};
+            members[rule.fields].push_back(i);
+        }
+
+        for (uint8_t fields = 0; fields < 32; fields++) {
+            if (members[fields].empty()) {
+                continue;
+            }
+            Group group;
+            group.mask = mask_of(fields);
+            group.first_rule = members[fields].front();
+            size_t size = 4;
+            while (size < members[fields].size() * 2) {
+                size <<= 1;
+            }
+            group.slots.resize(size);
+            group.shift = 64 - __builtin_ctzll(size);
+            for (uint32_t i: members[fields]) {
+                insert(group, keys[i], i);
+            }
+            groups.push_back(std::move(group));
+        }
+        std::sort(groups.begin(), groups.end(), [](const Group& a, const Group& b) {
+            return a.first_rule < b.first_rule;
+        });
+    }
+
+    Acl(const Acl&) = delete;
+    Acl& operator=(const Acl&) = delete;
+
+    ~Acl() {
+        delete[] hits;
+    }
+
+    /**
+     * @brief
+     * Lock free, counts the hit for worker
+     *
+     * @param worker id of the calling worker
+     * @param in_port
+     * @param vlan
+     * @param keys classified header of frame
+     * @param frame
+     * @param size
+     * @return AclAction of the first matching rule, PERMIT if none matches
+     */
+    AclAction evaluate(unsigned int worker, uint16_t in_port, uint16_t vlan, const FrameKeys& keys, const unsigned char* frame, int size) {
+        uint32_t rule = match(in_port, vlan, keys, frame, size);
+        if (rule == NO_RULE) {
+            return AclAction::PERMIT;
+        }
+        hits[worker * rules.size() + rule].add(1);
+        return rules[rule].action;
+    }
+
+    /**
+     * @brief
+     *
+     * @param in_port
+     * @param vlan id of the tag the kernel took off the frame, NO_VLAN to look for one in frame
+     * @param keys classified header of frame
+     * @param frame
+     * @param size
+     * @return index of the first rule matching frame, NO_RULE if none does
+     */
+    uint32_t match(uint16_t in_port, uint16_t vlan, const FrameKeys& keys, const unsigned char* frame, int size) {
+        uint16_t ethertype = keys.ethertype;
+        if (vlan == NO_VLAN && (ethertype == ETHERTYPE_VLAN || ethertype == 0x88A8) && size >= (int)sizeof(ether_header) + 4) {
+            vlan = (frame[14] << 8 | frame[15]) & 0x0FFF;
+            ethertype = frame[16] << 8 | frame[17];
+        }
+        Key key{keys.dst_mac, keys.src_mac, pack_rest(ethertype, vlan, in_port)};
+
+        uint32_t found = NO_RULE;
+        for (Group& group: groups) {
+            if (group.first_rule >= found) {
+                break; // every later group starts after the match
+            }
+            Key masked{key.dst & group.mask.dst, key.src & group.mask.src, key.rest & group.mask.rest};
+            uint32_t rule = lookup(group, masked);
+            if (rule < found) {
+                found = rule;
+            }
+        }
+        return found;
+    }
+
+    /**
+     * @brief
+     *
+     * @param rule index into rules()
+     * @return uint64_t hits summed over the workers, including those carried over
+     */
+    uint64_t get_hits(uint32_t rule) {
+        uint64_t total = rule < carried.size() ? carried[rule] : 0;
+        for (unsigned int w = 0; w < workers; w++) {
+            total += hits[w * rules.size() + rule].get();
+        }
+        return total;
+    }
+
+    /**
+     * @brief
+     * Continues the hit counts of the rules old has as well, matched by
+     * their config line, once no worker evaluates old any more (control path)
+     *
+     * @param old
+     */
+    void carry_hits(Acl& old) {
+        std::unordered_multimap<std::string, uint64_t> old_hits;
+        for (uint32_t i = 0; i < old.rules.size(); i++) {
+            old_hits.insert({old.rules[i].text, old.get_hits(i)});
+        }
+        carried.assign(rules.size(), 0);
+        for (uint32_t i = 0; i < rules.size(); i++) {
+            auto it = old_hits.find(rules[i].text);
+            if (it != old_hits.end()) {
+                carried[i] = it->second;
+                old_hits.erase(it);
+            }
+        }
+    }
+
+    const std::vector<AclRule>& get_rules() {
+        return rules;
+    }
+
+    /**
+     * @brief field combinations a lookup may probe
+     */
+    size_t group_count() {
+        return groups.size();
+    }
+
+    private:
+    struct Key {
+        uint64_t dst;
+        uint64_t src;
+        uint64_t rest; // ethertype, vlan and port, 16 bits each
+
+        bool operator==(const Key& other) const {
+            return dst == other.dst && src == other.src && rest == other.rest;
+        }
+    };
+
+    struct Slot {
+        Key key;
+        uint32_t rule = NO_RULE;
+    };
+
+    struct Group {
+        Key mask;
+        uint32_t first_rule;
+        std::vector<Slot> slots; // power of two, at most half full
+        unsigned int shift;
+    };
+
+    static uint64_t pack_rest(uint16_t ethertype, uint16_t vlan, uint16_t port) {
+        return (uint64_t)ethertype << 32 | (uint64_t)vlan << 16 | port;
+    }
+
+    static Key mask_of(uint8_t fields) {
+        return Key{
+            fields & AclRule::DST ? 0x0000FFFFFFFFFFFFULL : 0,
+            fields & AclRule::SRC ? 0x0000FFFFFFFFFFFFULL : 0,
+            pack_rest(fields & AclRule::ETHERTYPE ? 0xFFFF : 0, fields & AclRule::VLAN ? 0xFFFF : 0, fields & AclRule::PORT ? 0xFFFF : 0)
+        };
+    }
+
+    static size_t hash(const Group& group, const Key& key) {
+        uint64_t h = key.dst * 0x9E3779B97F4A7C15ULL;
+        h = (h ^ key.src) * 0xC2B2AE3D27D4EB4FULL;
+        h = (h ^ key.rest) * 0x9E3779B97F4A7C15ULL;
+        return h >> group.shift;
+    }
+
+    /**
+     * @brief keeps the earlier rule when key is already there
+     */
+    static void insert(Group& group, const Key& key, uint32_t rule) {
+        size_t mask = group.slots.size() - 1;
+        for (size_t i = hash(group, key); ; i = (i + 1) & mask) {
+            Slot& slot = group.slots[i];
+            if (slot.rule == NO_RULE) {
+                slot.key = key;
+                slot.rule = rule;
+                return;
+            }
+            if (slot.key == key) {
+                return;
+            }
+        }
+    }
+
+    static uint32_t lookup(const Group& group, const Key& key) {
+        size_t mask = group.slots.size() - 1;
+        for (size_t i = hash(group, key); ; i = (i + 1) & mask) {
+            const Slot& slot = group.slots[i];
+            if (slot.rule == NO_RULE || slot.key == key) {
+                return slot.rule;
+            }
+        }
+    }
+
+    std::vector<AclRule> rules;
+    std::vector<Group> groups; // by first rule
+    unsigned int workers;
+    Counter* hits; // [worker][rule]
+    std::vector<uint64_t> carried; // hits of the set this one replaced
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cstring>
+#include <vector>
+
+#include <networking/PacketPool.h>
+#include <networking/linklayer/mac_utils.h>
+
+/**
+ * @brief
+ * recvmmsg()/sendmmsg() over fixed size batches for sockets that can't use
+ * mmap rings. One syscall moves up to batch_size frames each way.
+ */
+class BatchIo {
+    public:
+    /**
+     * @brief
+     * Receive buffers are drawn from pool, one per batch slot
+     *
+     * @param sockfd
+     * @param batch_size
+     * @param pool
+     */
+    BatchIo(int sockfd, unsigned int batch_size, PacketPool* pool) {
+        this->sockfd = sockfd;
+        this->batch_size = batch_size;
+        this->pool = pool;
+
+        rx_packets.resize(batch_size, nullptr);
+        rx_iovecs.resize(batch_size);
+        rx_msgs.resize(batch_size);
+        rx_control.resize(batch_size * AUXDATA_SPACE / sizeof(cmsghdr) + 1);
+        tx_msgs.resize(batch_size);
+        discard.resize(pool->get_frame_size());
+    }
+
+    unsigned int get_batch_size() {
+        return batch_size;
+    }
+
+    /**
+     * @brief
+     * Receives up to batch_size frames with one recvmmsg() and calls
+     * on_frame(Packet* packet, uint16_t vlan) for each of them, ownership of
+     * packet passes on to the callback. vlan is the id of the tag the kernel
+     * took off, NO_VLAN without one. Frames that didn't get a pool buffer or didn't fit
+     * one are dropped.
+     *
+     * @param on_frame
+     * @return number of frames received, -1 with errno set on error
+     */
+    template <typename F>
+    int receive_batch(F&& on_frame) {
+        for (unsigned int i = 0; i < batch_size; i++) {
+            if (rx_packets[i] == nullptr) {
+                rx_packets[i] = pool->allocate();
+            }
+            // still drain the socket when the pool is exhausted
+            rx_iovecs[i].iov_base = rx_packets[i] ? rx_packets[i]->data : discard.data();
+            rx_iovecs[i].iov_len = discard.size();
+            memset(&rx_msgs[i], 0, sizeof(mmsghdr));
+            rx_msgs[i].msg_hdr.msg_iov = &rx_iovecs[i];
+            rx_msgs[i].msg_hdr.msg_iovlen = 1;
+            rx_msgs[i].msg_hdr.msg_control = (unsigned char*)rx_control.data() + i * AUXDATA_SPACE;
+            rx_msgs[i].msg_hdr.msg_controllen = AUXDATA_SPACE;
+        }
+
+        int n = recvmmsg(sockfd, rx_msgs.data(), batch_size, MSG_DONTWAIT, nullptr);
+
+        for (int i = 0; i < n; i++) {
+            if (rx_packets[i] == nullptr || (rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+                continue;
+            }
+            rx_packets[i]->size = (int)rx_msgs[i].msg_len;
+            Packet* packet = rx_packets[i];
+            rx_packets[i] = nullptr;
+            on_frame(packet, auxdata_vlan(&rx_msgs[i].msg_hdr));
+        }
+
+        return n;
+    }
+
+    /**
+     * @brief
+     * Sends up to batch_size frames with one sendmmsg()
+     *
+     * @param frames
+     * @param count
+     * @return number of frames sent, -1 with errno set on error
+     */
+    int send_batch(iovec* frames, unsigned int count) {
+        if (count > batch_size) {
+            count = batch_size;
+        }
+
+        for (unsigned int i = 0; i < count; i++) {
+            memset(&tx_msgs[i], 0, sizeof(mmsghdr));
+            tx_msgs[i].msg_hdr.msg_iov = &frames[i];
+            tx_msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        return sendmmsg(sockfd, tx_msgs.data(), count, MSG_DONTWAIT);
+    }
+
+    ~BatchIo() {
+        for (Packet* packet: rx_packets) {
+            if (packet) {
+                packet->release();
+            }
+        }
+    }
+
+    private:
+    int sockfd;
+    unsigned int batch_size;
+    PacketPool* pool;
+
+    std::vector<Packet*> rx_packets;
+    std::vector<unsigned char> discard;
+    std::vector<iovec> rx_iovecs;
+    std::vector<mmsghdr> rx_msgs;
+    std::vector<cmsghdr> rx_control; // AUXDATA_SPACE per message, cmsghdr for the alignment
+    std::vector<mmsghdr> tx_msgs;
+};
+
+#endif
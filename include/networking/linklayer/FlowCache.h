@@ -0,0 +1,140 @@
+#ifndef FLOW_CACHE_H
+#define FLOW_CACHE_H
+
+#include <cstdint>
+#include <cstring>
+
+#include "../Counter.h"
+
+/**
+ * @brief
+ * Direct mapped cache of switching decisions keyed on (ingress port, src
+ * mac, dst mac), one per worker so it needs no synchronization. A flow
+ * hashes to exactly one slot and a colliding flow simply replaces it.
+ *
+ * An entry holds while the mac table generation it was decided under is
+ * current, the cache was not cleared since and it is younger than the
+ * refresh period the caller passes. Expiring entries is what sends a cached
+ * flow back through learning now and then, so its source stays fresh in
+ * the mac table and an aged out destination is noticed.
+ */
+class FlowCache {
+    public:
+    static constexpr int MISS = -3; // apart from PacketSwitch::FLOOD and DROP, which are kept as 16 bit values
+
+    /**
+     * @brief
+     *
+     * @param capacity rounded up to a power of two
+     */
+    FlowCache(unsigned int capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots = new Entry[size];
+        shift = 64 - __builtin_ctzll(size);
+    }
+
+    FlowCache(const FlowCache&) = delete;
+    FlowCache& operator=(const FlowCache&) = delete;
+
+    ~FlowCache() {
+        delete[] slots;
+    }
+
+    /**
+     * @brief
+     *
+     * @param in_port
+     * @param frame at least the two mac addresses
+     * @param generation mac table generation read before the lookup
+     * @param now_ns
+     * @param refresh_ns how long a decision holds
+     * @return cached egress port, FLOOD or DROP, MISS if there is no valid entry
+     */
+    int lookup(uint16_t in_port, const unsigned char* frame, uint64_t generation, uint64_t now_ns, uint64_t refresh_ns) {
+        uint64_t macs;
+        uint64_t rest;
+        key_of(in_port, frame, macs, rest);
+        Entry& entry = slots[slot(macs, rest)];
+        if (entry.macs == macs && (entry.rest & REST_MASK) == rest && entry.stamp == (generation ^ epoch)
+            && now_ns - entry.decided_ns < refresh_ns) {
+            hits.add(1);
+            return (int16_t)(entry.rest >> 48);
+        }
+        misses.add(1);
+        return MISS;
+    }
+
+    /**
+     * @brief starts loading the slot of the flow of frame
+     */
+    void prefetch(uint16_t in_port, const unsigned char* frame) {
+        uint64_t macs;
+        uint64_t rest;
+        key_of(in_port, frame, macs, rest);
+        __builtin_prefetch(&slots[slot(macs, rest)]);
+    }
+
+    /**
+     * @brief
+     *
+     * @param in_port
+     * @param frame at least the two mac addresses
+     * @param out_port the switch's decision
+     * @param generation mac table generation read before the decision was made
+     * @param now_ns
+     */
+    void insert(uint16_t in_port, const unsigned char* frame, int out_port, uint64_t generation, uint64_t now_ns) {
+        uint64_t macs;
+        uint64_t rest;
+        key_of(in_port, frame, macs, rest);
+        Entry& entry = slots[slot(macs, rest)];
+        entry.macs = macs;
+        entry.rest = (uint64_t)(uint16_t)out_port << 48 | rest;
+        entry.stamp = generation ^ epoch;
+        entry.decided_ns = now_ns;
+    }
+
+    /**
+     * @brief invalidates every entry at once
+     */
+    void clear() {
+        epoch += 1ULL << 48; // far above any generation the mac table reaches
+    }
+
+    Counter hits;
+    Counter misses;
+
+    private:
+    static constexpr uint64_t REST_MASK = 0x0000FFFFFFFFFFFFULL;
+
+    // 32 bytes, two to a cache line
+    struct alignas(32) Entry {
+        uint64_t macs = 0;  // first 8 header bytes as they are
+        uint64_t rest = 0;  // out_port << 48 | last 4 mac bytes << 16 | in_port
+        uint64_t stamp = ~0ULL; // mac table generation ^ epoch, never matches when unused
+        uint64_t decided_ns = 0;
+    };
+
+    /**
+     * @brief the raw addresses of frame and in_port, no byte swapping needed for an exact match
+     */
+    static void key_of(uint16_t in_port, const unsigned char* frame, uint64_t& macs, uint64_t& rest) {
+        uint32_t tail;
+        memcpy(&macs, frame, sizeof(macs));
+        memcpy(&tail, frame + sizeof(macs), sizeof(tail));
+        rest = (uint64_t)tail << 16 | in_port;
+    }
+
+    size_t slot(uint64_t macs, uint64_t rest) {
+        return ((macs ^ rest * 0xC2B2AE3D27D4EB4FULL) * 0x9E3779B97F4A7C15ULL) >> shift;
+    }
+
+    Entry* slots;
+    int shift;
+    uint64_t epoch = 0;
+};
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef HEADER_CLASSIFIER_H
+#define HEADER_CLASSIFIER_H
+
+#include <cstdint>
+#include <cstring>
+#include <endian.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * @brief
+ * The ethernet header fields the switch and the acl work with, macs packed
+ * the way pack_mac_bytes() packs them
+ */
+struct FrameKeys {
+    uint64_t dst_mac;
+    uint64_t src_mac; // right after dst_mac, the vector paths store both with one write
+    uint16_t ethertype;
+};
+
+/**
+ * @brief
+ * Header parsing for a batch of frames. Every frame needs 16 readable
+ * bytes, which pool buffers and ring slots always have past a 14 byte
+ * header. The vector paths load the first 16 bytes of a header (two per
+ * AVX2 register) and byte reverse both macs into their 64 bit keys with a
+ * single shuffle, instead of shifting them together byte by byte.
+ *
+ * On x86 the SSSE3 and AVX2 versions are compiled in regardless of -march
+ * and picked at runtime by what the cpu supports. ARM builds use NEON when
+ * the compiler targets it (always on AArch64, -mfpu=neon on ARMv7).
+ */
+
+/**
+ * @brief two byte swapped loads per mac, portable and branch free
+ */
+inline void classify_headers_scalar(const unsigned char* const* frames, unsigned int count, FrameKeys* keys) {
+    for (unsigned int i = 0; i < count; i++) {
+        const unsigned char* frame = frames[i];
+        uint32_t dst_hi, src_hi;
+        uint16_t dst_lo, src_lo, ethertype;
+        memcpy(&dst_hi, frame, 4);
+        memcpy(&dst_lo, frame + 4, 2);
+        memcpy(&src_hi, frame + 6, 4);
+        memcpy(&src_lo, frame + 10, 2);
+        memcpy(&ethertype, frame + 12, 2);
+        keys[i].dst_mac = (uint64_t)be32toh(dst_hi) << 16 | be16toh(dst_lo);
+        keys[i].src_mac = (uint64_t)be32toh(src_hi) << 16 | be16toh(src_lo);
+        keys[i].ethertype = be16toh(ethertype);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// header bytes 5..0 and 11..6 into the low six bytes of two 64 bit lanes, the rest zeroed
+#define CLASSIFIER_MAC_SHUFFLE 5, 4, 3, 2, 1, 0, -1, -1, 11, 10, 9, 8, 7, 6, -1, -1
+
+__attribute__((target("ssse3")))
+inline void classify_headers_ssse3(const unsigned char* const* frames, unsigned int count, FrameKeys* keys) {
+    const __m128i shuffle = _mm_setr_epi8(CLASSIFIER_MAC_SHUFFLE);
+    for (unsigned int i = 0; i < count; i++) {
+        __m128i header = _mm_loadu_si128((const __m128i*)frames[i]);
+        _mm_storeu_si128((__m128i*)&keys[i].dst_mac, _mm_shuffle_epi8(header, shuffle));
+        keys[i].ethertype = __builtin_bswap16(_mm_extract_epi16(header, 6));
+    }
+}
+
+__attribute__((target("avx2")))
+inline void classify_headers_avx2(const unsigned char* const* frames, unsigned int count, FrameKeys* keys) {
+    const __m256i shuffle = _mm256_setr_epi8(CLASSIFIER_MAC_SHUFFLE, CLASSIFIER_MAC_SHUFFLE);
+    unsigned int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m256i headers = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)frames[i])),
+            _mm_loadu_si128((const __m128i*)frames[i + 1]), 1);
+        __m256i macs = _mm256_shuffle_epi8(headers, shuffle);
+        _mm_storeu_si128((__m128i*)&keys[i].dst_mac, _mm256_castsi256_si128(macs));
+        _mm_storeu_si128((__m128i*)&keys[i + 1].dst_mac, _mm256_extracti128_si256(macs, 1));
+        keys[i].ethertype = __builtin_bswap16(_mm256_extract_epi16(headers, 6));
+        keys[i + 1].ethertype = __builtin_bswap16(_mm256_extract_epi16(headers, 14));
+    }
+    if (i < count) {
+        classify_headers_ssse3(frames + i, count - i, keys + i);
+    }
+}
+
+#undef CLASSIFIER_MAC_SHUFFLE
+
+#elif defined(__ARM_NEON)
+
+inline void classify_headers_neon(const unsigned char* const* frames, unsigned int count, FrameKeys* keys) {
+    // out of range indexes read as zero
+    static const uint8_t dst_index[8] = {5, 4, 3, 2, 1, 0, 0xFF, 0xFF};
+    static const uint8_t src_index[8] = {11, 10, 9, 8, 7, 6, 0xFF, 0xFF};
+    const uint8x8_t dst_shuffle = vld1_u8(dst_index);
+    const uint8x8_t src_shuffle = vld1_u8(src_index);
+    for (unsigned int i = 0; i < count; i++) {
+        uint8x16_t header = vld1q_u8(frames[i]);
+        uint8x8x2_t table = {{vget_low_u8(header), vget_high_u8(header)}};
+        vst1q_u8((uint8_t*)&keys[i].dst_mac, vcombine_u8(vtbl2_u8(table, dst_shuffle), vtbl2_u8(table, src_shuffle)));
+        keys[i].ethertype = frames[i][12] << 8 | frames[i][13];
+    }
+}
+
+#endif
+
+using HeaderClassifierFn = void (*)(const unsigned char* const*, unsigned int, FrameKeys*);
+
+/**
+ * @brief
+ * The fastest version this cpu runs
+ *
+ * @param name set to the version's name if not nullptr
+ * @return HeaderClassifierFn
+ */
+inline HeaderClassifierFn best_header_classifier(const char** name = nullptr) {
+    const char* chosen = "scalar";
+    HeaderClassifierFn fn = classify_headers_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2")) {
+        chosen = "avx2";
+        fn = classify_headers_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3")) {
+        chosen = "ssse3";
+        fn = classify_headers_ssse3;
+    }
+#elif defined(__ARM_NEON)
+    chosen = "neon";
+    fn = classify_headers_neon;
+#endif
+    if (name != nullptr) {
+        *name = chosen;
+    }
+    return fn;
+}
+
+/**
+ * @brief
+ * Fills keys[i] from the header of frames[i]
+ *
+ * @param frames each with at least 16 readable bytes
+ * @param count
+ * @param keys
+ */
+inline void classify_headers(const unsigned char* const* frames, unsigned int count, FrameKeys* keys) {
+    static const HeaderClassifierFn fn = best_header_classifier();
+    fn(frames, count, keys);
+}
+
+#endif
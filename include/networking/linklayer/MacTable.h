@@ -1,7 +1,10 @@
 #ifndef MAC_TABLE_H
 #define MAC_TABLE_H
 
-#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
 #include "time_utils.h"
 
 #ifndef NDEBUG
@@ -9,51 +12,408 @@
 #include "mac_utils.h"
 #endif
 
+/**
+ * @brief
+ * Flat open addressing (linear probing) table of mac -> port.
+ *
+ * Every slot is one 64 bit key holding the 48 bit mac and a 16 bit port
+ * index, plus the time the mac was last seen. Lookup and learning are a
+ * single probe sequence and a mac moving between ports is updated in place.
+ * Removal uses backward shift deletion so there are no tombstones.
+ *
+ * Aging is an incremental sweep: every age() call checks a slice of the
+ * table proportional to the time passed, so a full pass completes every half
+ * timeout without ever walking the whole table for one frame. Entries past
+ * the timeout already read as unknown before the sweep reaches them.
+ *
+ * Readers never lock: lookup() and needsLearning() read the slot words
+ * atomically, at most one pass over the table per probe. Writers (learning,
+ * aging, port removal) are serialized by a mutex and publish a slot by
+ * storing its key last. Backward shifts run inside a sequence count, so a
+ * probe that overlapped one, and may have missed the entry being moved,
+ * probes again instead of reporting the mac as unknown.
+ *
+ * Every change that can alter a lookup (a mac learned, moved, relearned
+ * after aging out or removed) bumps a generation counter once it is
+ * visible, so decisions cached under an older generation can be told apart
+ * without a callback.
+ */
 class MacTable {
     public:
-    MacTable() {
-    }
-
-    void removeExpired(uint64_t timeout_ns) {
-        uint64_t now = now_ns_monotonic();
-        
-        for (auto it=table.begin(); it!=table.end(); it++) {
-            for (auto it2=it->second.begin(); it2!=it->second.end(); ) {
-                if (now - it2->second >= timeout_ns) {
-                    #ifndef NDEBUG
-                    std::cerr << "Deleting expired entry: ";
-                    std::cerr << it->first << ": ";
-                    std::cerr << mac_to_str(unpack_mac_bytes(it2->first).data());
-                    std::cerr << std::endl;
-                    #endif
-                    it2 = it->second.erase(it2);
-                }
-                else {
-                    it2++;
+    static constexpr uint16_t NO_PORT = 0xFFFF;
+
+    /**
+     * @brief
+     *
+     * @param capacity rounded up to a power of two, at most 3/4 of it is filled
+     */
+    MacTable(unsigned int capacity = 8192, uint64_t aging_timeout_ns = (uint64_t)10 * 1000 * 1'000'000) {
+        unsigned int size = 16;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        table = new Entry[size];
+        mask = size - 1;
+        shift = 64 - __builtin_ctzll(size);
+        max_entries = size / 4 * 3;
+        this->aging_timeout_ns = aging_timeout_ns;
+    }
+
+    MacTable(const MacTable&) = delete;
+    MacTable& operator=(const MacTable&) = delete;
+
+    ~MacTable() {
+        delete[] table;
+    }
+
+    /**
+     * @brief
+     * Lock free, safe against concurrent writers
+     *
+     * @param mac
+     * @param now_ns
+     * @return port index, NO_PORT if mac is unknown or aged
+     */
+    uint16_t lookup(uint64_t mac, uint64_t now_ns) {
+        uint64_t key;
+        uint64_t timestamp;
+        if (!find(mac, key, timestamp) || expired(timestamp, now_ns, getAgingTimeout())) {
+            return NO_PORT;
+        }
+        return key_port(key);
+    }
+
+    /**
+     * @brief
+     * Starts loading the slot mac hashes to, so a lookup shortly after
+     * finds it in cache. Meant for a batch of frames: prefetch all of them,
+     * then look them up.
+     *
+     * @param mac
+     */
+    void prefetch(uint64_t mac) {
+        __builtin_prefetch(&table[slot(mac)]);
+    }
+
+    /**
+     * @brief
+     * Whether addEntry(port, mac, now_ns) would change anything worth
+     * writing: mac is unknown, moved or was last refreshed more than 1/8 of
+     * the aging timeout ago. Lets callers skip the writer lock for sources
+     * that are already learned. Lock free.
+     *
+     * @param port
+     * @param mac
+     * @param now_ns
+     * @return boolean
+     */
+    bool needsLearning(uint16_t port, uint64_t mac, uint64_t now_ns) {
+        if (mac == 0) {
+            return false;
+        }
+        uint64_t key;
+        uint64_t timestamp;
+        if (!find(mac, key, timestamp)) {
+            return true;
+        }
+        return key != make_key(mac, port) || expired(timestamp, now_ns, getAgingTimeout() / 8);
+    }
+
+    /**
+     * @brief
+     * Learns mac on port or refreshes it, moving it over if it was seen on
+     * another port before
+     *
+     * @param port
+     * @param mac
+     * @param now_ns
+     */
+    void addEntry(uint16_t port, uint64_t mac, uint64_t now_ns) {
+        if (mac == 0) {
+            return; // all zero key marks an empty slot
+        }
+
+        write_lock.lock();
+        size_t i = slot(mac);
+        for (; load_key(i) != 0; i = (i + 1) & mask) {
+            if (key_mac(load_key(i)) == mac) {
+                // moved, or aged out and not swept yet, lookups change either way
+                uint64_t timestamp = table[i].timestamp.load(std::memory_order_relaxed);
+                bool changed = load_key(i) != make_key(mac, port) || expired(timestamp, now_ns, getAgingTimeout());
+                // a worker with an older clock reading must not age the entry
+                store(i, make_key(mac, port), std::max(timestamp, now_ns));
+                if (changed) {
+                    bump_generation();
                 }
+                write_lock.unlock();
+                return;
             }
         }
+
+        if (entries >= max_entries) {
+            learn_dropped.fetch_add(1, std::memory_order_relaxed);
+            write_lock.unlock();
+            return;
+        }
+
+        store(i, make_key(mac, port), now_ns);
+        entries++;
+        bump_generation();
+        write_lock.unlock();
     }
 
-    void addEntry(std::string ifname, uint64_t mac) {
-        if (!table.contains(ifname)) {
-            table.insert({ifname, std::unordered_map<uint64_t, uint64_t>()});
+    /**
+     * @brief
+     * Sweeps the slice of the table that is due since the last call,
+     * meant to be called once per batch of frames. Skipped while another
+     * thread writes to the table, the next call sweeps what is due then.
+     *
+     * @param now_ns
+     */
+    void age(uint64_t now_ns) {
+        if (!write_lock.try_lock()) {
+            return;
         }
 
-        if (table.at(ifname).contains(mac)) {
-            table.at(ifname).at(mac) = now_ns_monotonic();
+        if (last_age_ns == 0 || now_ns < last_age_ns) {
+            last_age_ns = now_ns;
+            write_lock.unlock();
+            return;
+        }
+
+        uint64_t aging_timeout_ns = getAgingTimeout();
+        uint64_t period_ns = std::max<uint64_t>(aging_timeout_ns / 2, 1);
+        uint64_t elapsed_ns = now_ns - last_age_ns;
+        size_t due = elapsed_ns >= period_ns ? mask + 1 : (size_t)((double)elapsed_ns / period_ns * (mask + 1));
+
+        if (due == 0) {
+            write_lock.unlock();
+            return; // let the time add up to at least one slot
         }
-        else {
-            table.at(ifname).insert({mac, now_ns_monotonic()});
+        last_age_ns = now_ns;
+
+        for (size_t checked = 0; checked < due; checked++) {
+            size_t i = sweep_cursor;
+            uint64_t key = load_key(i);
+            if (key != 0 && expired(table[i].timestamp.load(std::memory_order_relaxed), now_ns, aging_timeout_ns)) {
+                #ifndef NDEBUG
+                std::cerr << "Deleting expired entry: ";
+                std::cerr << key_port(key) << ": ";
+                std::cerr << mac_to_str(unpack_mac_bytes(key_mac(key)).data());
+                std::cerr << std::endl;
+                #endif
+                // the slot now holds a shifted entry that needs checking too
+                erase(i);
+                aged_out.fetch_add(1, std::memory_order_relaxed);
+            }
+            else {
+                sweep_cursor = (sweep_cursor + 1) & mask;
+            }
         }
+        write_lock.unlock();
+    }
+
+    void setAgingTimeout(uint64_t timeout_ns) {
+        aging_timeout_ns.store(timeout_ns, std::memory_order_relaxed);
     }
 
-    void removeInterface(std::string ifname) {
-        table.erase(ifname);
+    uint64_t getAgingTimeout() {
+        return aging_timeout_ns.load(std::memory_order_relaxed);
     }
 
-    // ifname: {mac: timestamp}
-    std::unordered_map<std::string, std::unordered_map<uint64_t, uint64_t>> table;
+    /**
+     * @brief
+     * Read before a lookup, a decision made from the lookup is still good
+     * while the generation is unchanged. Lock free.
+     *
+     * @return uint64_t
+     */
+    uint64_t getGeneration() {
+        return generation.load(std::memory_order_acquire);
+    }
+
+    void removePort(uint16_t port) {
+        write_lock.lock();
+        for (size_t i = 0; i <= mask; ) {
+            uint64_t key = load_key(i);
+            if (key != 0 && key_port(key) == port) {
+                erase(i);
+            }
+            else {
+                i++;
+            }
+        }
+        write_lock.unlock();
+    }
+
+    /**
+     * @brief
+     * Calls f(uint64_t mac, uint16_t port, uint64_t timestamp) for every entry,
+     * holds the writer lock meanwhile
+     *
+     * @param f
+     */
+    template <typename F>
+    void forEach(F&& f) {
+        write_lock.lock();
+        for (size_t i = 0; i <= mask; i++) {
+            uint64_t key = load_key(i);
+            if (key != 0) {
+                f(key_mac(key), key_port(key), table[i].timestamp.load(std::memory_order_relaxed));
+            }
+        }
+        write_lock.unlock();
+    }
+
+    size_t size() {
+        return entries.load(std::memory_order_relaxed);
+    }
+
+    // macs not learned because the table was full
+    std::atomic<uint64_t> learn_dropped{0};
+    // entries removed by aging
+    std::atomic<uint64_t> aged_out{0};
+
+    private:
+    struct Entry {
+        std::atomic<uint64_t> key{0}; // mac << 16 | port, 0 when empty
+        std::atomic<uint64_t> timestamp{0};
+    };
+
+    static uint64_t make_key(uint64_t mac, uint16_t port) {
+        return mac << 16 | port;
+    }
+
+    static uint64_t key_mac(uint64_t key) {
+        return key >> 16;
+    }
+
+    static uint16_t key_port(uint64_t key) {
+        return key & 0xFFFF;
+    }
+
+    /**
+     * @brief
+     * Whether an entry last seen at timestamp is timeout_ns old by now_ns.
+     * Workers read the clock at different times, a timestamp ahead of
+     * now_ns is fresh.
+     */
+    static bool expired(uint64_t timestamp, uint64_t now_ns, uint64_t timeout_ns) {
+        return timestamp <= now_ns && now_ns - timestamp >= timeout_ns;
+    }
+
+    size_t slot(uint64_t mac) {
+        return (mac * 0x9E3779B97F4A7C15ULL) >> shift;
+    }
+
+    /**
+     * @brief after the change is stored (writer lock held)
+     */
+    void bump_generation() {
+        generation.store(generation.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    uint64_t load_key(size_t i) {
+        return table[i].key.load(std::memory_order_acquire);
+    }
+
+    /**
+     * @brief
+     * Reads the slot of mac without locking, probing again while backward
+     * shifts overlap the probe
+     *
+     * @param mac
+     * @param key
+     * @param timestamp
+     * @return false if mac is not in the table
+     */
+    bool find(uint64_t mac, uint64_t& key, uint64_t& timestamp) {
+        while (true) {
+            uint64_t seq = shifts.load(std::memory_order_acquire);
+            bool found = probe(mac, key, timestamp);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (!(seq & 1) && shifts.load(std::memory_order_relaxed) == seq) {
+                return found;
+            }
+        }
+    }
+
+    /**
+     * @brief one probe sequence for mac, at most one pass over the table
+     */
+    bool probe(uint64_t mac, uint64_t& key, uint64_t& timestamp) {
+        size_t i = slot(mac);
+        for (size_t probes = 0; probes <= mask; probes++, i = (i + 1) & mask) {
+            key = load_key(i);
+            if (key == 0) {
+                return false;
+            }
+            if (key_mac(key) == mac) {
+                timestamp = table[i].timestamp.load(std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief
+     * Writes slot i, the key goes last so a reader that sees it also sees the timestamp (writer lock held)
+     */
+    void store(size_t i, uint64_t key, uint64_t timestamp) {
+        table[i].timestamp.store(timestamp, std::memory_order_relaxed);
+        table[i].key.store(key, std::memory_order_release);
+    }
+
+    /**
+     * @brief
+     * Backward shift deletion of slot i (writer lock held)
+     */
+    void erase(size_t i) {
+        // odd while entries move, readers overlapping it probe again
+        uint64_t seq = shifts.load(std::memory_order_relaxed);
+        shifts.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            uint64_t key = load_key(j);
+            if (key == 0) {
+                break;
+            }
+            // move j back into the hole unless its home slot lies cyclically in (i, j]
+            size_t home = slot(key_mac(key));
+            bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays) {
+                store(i, key, table[j].timestamp.load(std::memory_order_relaxed));
+                i = j;
+            }
+        }
+        table[i].key.store(0, std::memory_order_release);
+        table[i].timestamp.store(0, std::memory_order_relaxed);
+        entries.fetch_sub(1, std::memory_order_relaxed);
+        shifts.store(seq + 2, std::memory_order_release);
+        bump_generation();
+    }
+
+    Entry* table;
+    size_t mask;
+    int shift;
+    std::atomic<size_t> entries{0};
+    size_t max_entries;
+    // sequence count of backward shifts, odd while one runs
+    std::atomic<uint64_t> shifts{0};
+
+    // serializes every change to the table, readers go without
+    std::mutex write_lock;
+
+    std::atomic<uint64_t> aging_timeout_ns;
+    uint64_t last_age_ns = 0;
+    size_t sweep_cursor = 0;
+
+    // read for every cached decision, kept off the lines the writer touches otherwise
+    alignas(64) std::atomic<uint64_t> generation{0};
 };
 
 #endif
@@ -0,0 +1,256 @@
+#ifndef PACKET_RING_H
+#define PACKET_RING_H
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "mac_utils.h"
+
+struct RingConfig {
+    unsigned int block_size = 1 << 16;
+    unsigned int block_count = 32;
+    unsigned int block_timeout_ms = 1;
+    unsigned int tx_block_count = 8;
+    unsigned int tx_frame_size = 2048;
+};
+
+/**
+ * @brief
+ * TPACKET_V3 PACKET_RX_RING and/or PACKET_TX_RING mapped over an already
+ * bound AF_PACKET socket.
+ *
+ * The kernel fills whole rx blocks of frames, user space walks a block in
+ * place and hands it back, so received frames are never copied into user
+ * buffers. Outgoing frames are written into tx slots and handed to the kernel
+ * together by a single flush().
+ */
+class PacketRing {
+    public:
+    /**
+     * @brief
+     * Sets up and maps the requested rings, throws std::runtime_error on
+     * failure (the socket is left usable for plain recv()/send() in that case).
+     *
+     * @param sockfd
+     * @param config
+     * @param rx map a rx ring
+     * @param tx map a tx ring
+     */
+    PacketRing(int sockfd, const RingConfig& config, bool rx, bool tx) {
+        this->sockfd = sockfd;
+        this->block_size = config.block_size;
+
+        int version = TPACKET_V3;
+        if (setsockopt(sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+            throw std::runtime_error(std::string("PACKET_VERSION: ") + strerror(errno));
+        }
+
+        if (rx) {
+            tpacket_req3 req{};
+            req.tp_block_size = block_size;
+            req.tp_block_nr = config.block_count;
+            // V3 rx frames are variable length inside a block, frame_size only sizes tp_frame_nr
+            req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+            req.tp_frame_nr = (block_size / req.tp_frame_size) * config.block_count;
+            req.tp_retire_blk_tov = config.block_timeout_ms;
+
+            if (setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1) {
+                throw std::runtime_error(std::string("PACKET_RX_RING: ") + strerror(errno));
+            }
+
+            rx_block_count = config.block_count;
+        }
+
+        if (tx) {
+            // skip malformed frames instead of stalling the whole ring on them
+            int loss = 1;
+            setsockopt(sockfd, SOL_PACKET, PACKET_LOSS, &loss, sizeof(loss));
+
+            tx_frame_size = config.tx_frame_size;
+            tx_frames_per_block = block_size / tx_frame_size;
+
+            tpacket_req3 req{};
+            req.tp_block_size = block_size;
+            req.tp_block_nr = config.tx_block_count;
+            req.tp_frame_size = tx_frame_size;
+            req.tp_frame_nr = tx_frames_per_block * config.tx_block_count;
+
+            if (setsockopt(sockfd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) == -1) {
+                int err = errno;
+                unmap_rings(false);
+                throw std::runtime_error(std::string("PACKET_TX_RING: ") + strerror(err));
+            }
+
+            tx_frame_count = req.tp_frame_nr;
+        }
+
+        // rx ring comes first in the mapping, tx ring right after it
+        size_t rx_size = (size_t)block_size * rx_block_count;
+        map_size = rx_size + (size_t)block_size * (tx ? config.tx_block_count : 0);
+
+        void* addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, sockfd, 0);
+        if (addr == MAP_FAILED) {
+            // MAP_LOCKED fails without CAP_IPC_LOCK / RLIMIT_MEMLOCK, retry without it
+            addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, sockfd, 0);
+        }
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            unmap_rings(tx);
+            throw std::runtime_error(std::string("mmap packet ring: ") + strerror(err));
+        }
+        map = (unsigned char*)addr;
+        tx_map = map + rx_size;
+    }
+
+    bool rx_enabled() {
+        return rx_block_count != 0;
+    }
+
+    bool tx_enabled() {
+        return tx_frame_count != 0;
+    }
+
+    /**
+     * @brief
+     * Walks the next rx block if the kernel has handed it to user space,
+     * calling on_frame(unsigned char* frame, int size, uint16_t vlan) for
+     * every complete frame in it, vlan being the id of the tag the kernel
+     * took off or NO_VLAN. Frames stay valid until on_done() returns, which
+     * is called once after the last frame so batched frames can be handled.
+     *
+     * @param on_frame
+     * @param on_done
+     * @return false if no block was ready
+     */
+    template <typename F, typename D>
+    bool receive_block(F&& on_frame, D&& on_done) {
+        tpacket_block_desc* block = (tpacket_block_desc*)(map + (size_t)current_block * block_size);
+
+        if ((__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0) {
+            return false;
+        }
+
+        int num_pkts = block->hdr.bh1.num_pkts;
+        tpacket3_hdr* hdr = (tpacket3_hdr*)((unsigned char*)block + block->hdr.bh1.offset_to_first_pkt);
+
+        for (int i = 0; i < num_pkts; i++) {
+            // drop frames the kernel had to truncate to fit the block
+            if (hdr->tp_snaplen == hdr->tp_len) {
+                uint16_t vlan = hdr->tp_status & TP_STATUS_VLAN_VALID ? hdr->hv1.tp_vlan_tci & 0x0FFF : NO_VLAN;
+                on_frame((unsigned char*)hdr + hdr->tp_mac, (int)hdr->tp_snaplen, vlan);
+            }
+            hdr = (tpacket3_hdr*)((unsigned char*)hdr + hdr->tp_next_offset);
+        }
+        on_done();
+
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        current_block = (current_block + 1) % rx_block_count;
+
+        return true;
+    }
+
+    /**
+     * @brief
+     * Copies a frame into the next free tx slot. Nothing is sent until flush().
+     *
+     * @param data
+     * @param size
+     * @return false if the ring is full or the frame doesn't fit a slot
+     */
+    bool queue_frame(const unsigned char* data, int size) {
+        if ((unsigned int)size > tx_frame_size - TX_DATA_OFFSET) {
+            return false;
+        }
+
+        tpacket3_hdr* hdr = tx_frame(tx_head);
+        unsigned int status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+
+        if (status != TP_STATUS_AVAILABLE && status != TP_STATUS_WRONG_FORMAT) {
+            return false;
+        }
+
+        memcpy((unsigned char*)hdr + TX_DATA_OFFSET, data, size);
+        hdr->tp_len = size;
+        hdr->tp_snaplen = size;
+        hdr->tp_next_offset = 0;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+        tx_head = (tx_head + 1) % tx_frame_count;
+        tx_pending++;
+
+        return true;
+    }
+
+    /**
+     * @brief
+     * Largest frame a tx slot holds. send() on the socket goes through the
+     * tx ring as well, so larger frames can't leave through it at all.
+     */
+    unsigned int get_max_tx_frame() {
+        return tx_frame_size - TX_DATA_OFFSET;
+    }
+
+    /**
+     * @brief
+     * Hands every queued tx slot to the kernel with one send(). If the
+     * kernel had no room (EAGAIN, ENOBUFS) the slots it did not take stay
+     * queued, and so does the next flush(), nothing else would send them.
+     *
+     * @return send() result, 0 if nothing was queued
+     */
+    int flush() {
+        if (tx_pending == 0) {
+            return 0;
+        }
+        int r = send(sockfd, nullptr, 0, MSG_DONTWAIT);
+        if (r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != EINTR)) {
+            tx_pending = 0;
+        }
+        return r;
+    }
+
+    ~PacketRing() {
+        munmap(map, map_size);
+    }
+
+    private:
+    // V3 tx data starts right after the aligned header (TPACKET3_HDRLEN minus sockaddr_ll)
+    static constexpr unsigned int TX_DATA_OFFSET = TPACKET_ALIGN(sizeof(tpacket3_hdr));
+
+    tpacket3_hdr* tx_frame(unsigned int index) {
+        return (tpacket3_hdr*)(tx_map + (size_t)(index / tx_frames_per_block) * block_size
+                                      + (size_t)(index % tx_frames_per_block) * tx_frame_size);
+    }
+
+    void unmap_rings(bool tx) {
+        tpacket_req3 off{};
+        if (rx_block_count) {
+            setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, &off, sizeof(off));
+        }
+        if (tx) {
+            setsockopt(sockfd, SOL_PACKET, PACKET_TX_RING, &off, sizeof(off));
+        }
+    }
+
+    int sockfd;
+    unsigned char* map = nullptr;
+    size_t map_size = 0;
+    unsigned int block_size;
+
+    unsigned int rx_block_count = 0;
+    unsigned int current_block = 0;
+
+    unsigned char* tx_map = nullptr;
+    unsigned int tx_frame_size = 0;
+    unsigned int tx_frames_per_block = 0;
+    unsigned int tx_frame_count = 0;
+    unsigned int tx_head = 0;
+    unsigned int tx_pending = 0;
+};
+
+#endif
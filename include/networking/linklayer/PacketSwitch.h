@@ -2,49 +2,140 @@
 #define PACKET_SWITCH_H
 
 #include "MacTable.h"
+#include "FlowCache.h"
+#include "HeaderClassifier.h"
 #include <net/ethernet.h>
 #include <string.h>
 #include "mac_utils.h"
 
 class PacketSwitch {
     public:
+    static constexpr int FLOOD = -1;
+    static constexpr int DROP = -2;
 
-    PacketSwitch() {
+    PacketSwitch(unsigned int mac_table_size = 8192, uint64_t aging_timeout_ns = (uint64_t)10 * 1000 * 1'000'000)
+        : macTable(mac_table_size, aging_timeout_ns) {
     }
 
-    std::string switchPacket(std::string src_ifname, unsigned char* packet, int packet_size) {
-        ether_header* header = (ether_header *) packet;
-        uint64_t dest_mac = pack_mac_bytes(header->ether_dhost);
-        uint64_t src_mac = pack_mac_bytes(header->ether_shost);
-        
-        if (src_mac == 0x0000FFFFFFFFFFFFULL) {
-            return "DROP"; // src mac is broadcast, probably malicious
+    /**
+     * @brief
+     * Runs the aging sweep, meant to be called once per batch
+     *
+     * @param now_ns
+     */
+    void age(uint64_t now_ns) {
+        macTable.age(now_ns);
+    }
+
+    /**
+     * @brief
+     * Learns the source of frame on in_port and decides where it goes.
+     * Safe to call from several threads at once.
+     *
+     * @param in_port
+     * @param frame
+     * @param size
+     * @param now_ns
+     * @return egress port id, FLOOD or DROP
+     */
+    int switchPacket(uint16_t in_port, const unsigned char* frame, int size, uint64_t now_ns) {
+        const ether_header* header = (const ether_header *) frame;
+        return switchKeys(in_port, FrameKeys{pack_mac_bytes(header->ether_dhost), pack_mac_bytes(header->ether_shost), 0}, now_ns);
+    }
+
+    /**
+     * @brief
+     * switchPacket() for a header classify_headers() already parsed
+     *
+     * @param in_port
+     * @param keys
+     * @param now_ns
+     * @return egress port id, FLOOD or DROP
+     */
+    int switchKeys(uint16_t in_port, const FrameKeys& keys, uint64_t now_ns) {
+        if (keys.src_mac & 0x010000000000ULL) {
+            return DROP; // src mac is broadcast or multicast, probably malicious (normally gone in the socket filter)
         }
 
-        uint64_t table_timeout_ns;
+        // known sources are only read, the table takes its writer lock for the rest
+        if (macTable.needsLearning(in_port, keys.src_mac, now_ns)) {
+            macTable.addEntry(in_port, keys.src_mac, now_ns);
+        }
 
-        #ifndef NDEBUG
-        table_timeout_ns = (uint64_t)10 * 1000 * 1'000'000;
-        #else
-        table_timeout_ns = (uint64_t)10 * 1000 * 1'000'000;
-        #endif
+        uint16_t dest_port = macTable.lookup(keys.dst_mac, now_ns);
 
-        macTable.removeExpired(table_timeout_ns);
-        macTable.addEntry(src_ifname, src_mac);
+        if (dest_port == MacTable::NO_PORT) {
+            return FLOOD;
+        }
 
-        for (auto it=macTable.table.begin(); it!=macTable.table.end(); it++) {
-            if (it->first == src_ifname) {
-                continue;
-            }
-            
-            if (it->second.contains(dest_mac)) {
-                return it->first;
+        if (dest_port == in_port) {
+            return DROP; // destination sits on the segment the frame came from
+        }
+
+        return dest_port;
+    }
+
+    /**
+     * @brief
+     * Starts loading everything switching a batch of frames will read: the
+     * flow cache slot of every frame and the mac table slots of both its
+     * macs. The hashes of the whole batch are computed back to back and the
+     * cache misses overlap, instead of every frame stalling on its own.
+     *
+     * @param cache the calling worker's flow cache, nullptr without one
+     * @param in_port
+     * @param frames
+     * @param keys classified headers of frames
+     * @param count
+     */
+    void prefetch(FlowCache* cache, uint16_t in_port, const unsigned char* const* frames, const FrameKeys* keys, unsigned int count) {
+        for (unsigned int i = 0; i < count; i++) {
+            if (cache != nullptr) {
+                cache->prefetch(in_port, frames[i]);
             }
+            macTable.prefetch(keys[i].src_mac);
+            macTable.prefetch(keys[i].dst_mac);
+        }
+    }
+
+    /**
+     * @brief
+     * switchPacket() behind a worker's flow cache. A flow decided less than
+     * 1/8 of the aging timeout ago, with no mac table change since, gets the
+     * cached decision without touching the table. Others take the full path,
+     * which refreshes the source the way switchPacket() would, and their
+     * decision is cached.
+     *
+     * @param cache the calling worker's
+     * @param in_port
+     * @param frame
+     * @param keys classified header of frame
+     * @param now_ns
+     * @return egress port id, FLOOD or DROP
+     */
+    int switchCached(FlowCache& cache, uint16_t in_port, const unsigned char* frame, const FrameKeys& keys, uint64_t now_ns) {
+        // before the decision, a change while it is made leaves the entry stale
+        uint64_t generation = macTable.getGeneration();
+        int out_port = cache.lookup(in_port, frame, generation, now_ns, macTable.getAgingTimeout() / 8);
+        if (out_port != FlowCache::MISS) {
+            return out_port;
         }
 
-        return "";
+        out_port = switchKeys(in_port, keys, now_ns);
+        cache.insert(in_port, frame, out_port, generation, now_ns);
+        return out_port;
+    }
+
+    /**
+     * @brief
+     * Forgets every mac learned on port, call before the id is handed out again
+     *
+     * @param port
+     */
+    void removePort(uint16_t port) {
+        macTable.removePort(port);
     }
-    
+
     MacTable macTable;
 };
 
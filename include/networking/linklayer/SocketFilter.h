@@ -0,0 +1,85 @@
+#ifndef SOCKET_FILTER_H
+#define SOCKET_FILTER_H
+
+#include <cerrno>
+#include <cstdint>
+#include <vector>
+#include <sys/socket.h>
+#include <linux/filter.h>
+
+/**
+ * @brief
+ * Classic BPF program for the packet sockets of a port. It drops in the
+ * kernel what the switch would drop after the copy to user space: frames
+ * with a group (broadcast or multicast) source mac, frames from or to a
+ * blocked mac and frames of a blocked ethertype. Every check ends in its
+ * own return, so no jump needs more than the 8 bit offsets cBPF has.
+ */
+class SocketFilter {
+    public:
+    SocketFilter(const std::vector<uint64_t>& blocked_macs, const std::vector<uint16_t>& blocked_ethertypes) {
+        // group bit of the source mac
+        load(BPF_B, 6);
+        program.push_back(BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x01, 0, 1));
+        drop();
+
+        for (uint64_t mac: blocked_macs) {
+            match_mac(0, mac); // destination
+            match_mac(6, mac); // source
+        }
+
+        if (!blocked_ethertypes.empty()) {
+            load(BPF_H, 12);
+            for (uint16_t ethertype: blocked_ethertypes) {
+                program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ethertype, 0, 1));
+                drop();
+            }
+        }
+
+        program.push_back(BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF)); // the whole frame
+    }
+
+    /**
+     * @brief
+     * Attaches the program to fd, replacing any filter it had
+     *
+     * @param fd
+     * @return boolean (Returns false with errno set if the program is too long or the kernel refused it)
+     */
+    bool attach(int fd) {
+        if (program.size() > BPF_MAXINSNS) {
+            errno = E2BIG;
+            return false;
+        }
+        sock_fprog fprog{static_cast<unsigned short>(program.size()), program.data()};
+        return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) == 0;
+    }
+
+    size_t size() {
+        return program.size();
+    }
+
+    private:
+    void load(uint16_t size, uint32_t offset) {
+        program.push_back(BPF_STMT(BPF_LD | size | BPF_ABS, offset));
+    }
+
+    void drop() {
+        program.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+    }
+
+    /**
+     * @brief drops the frame if the 6 bytes at offset are mac (absolute loads are big endian)
+     */
+    void match_mac(uint32_t offset, uint64_t mac) {
+        load(BPF_W, offset);
+        program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(mac >> 16), 0, 3));
+        load(BPF_H, offset + 4);
+        program.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, static_cast<uint32_t>(mac & 0xFFFF), 0, 1));
+        drop();
+    }
+
+    std::vector<sock_filter> program;
+};
+
+#endif
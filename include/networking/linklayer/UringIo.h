@@ -0,0 +1,441 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "mac_utils.h"
+
+/**
+ * @brief
+ * One io_uring per worker, driven through the raw syscalls. Every socket of
+ * the worker keeps a multishot recvmsg() armed that the kernel completes
+ * into buffers of a provided buffer ring, so a received frame costs no
+ * syscall of its own. Sends are queued as submissions and go to the kernel
+ * together with the next submit_and_wait(), which is also where the worker
+ * sleeps.
+ *
+ * Needs Linux 6.0 or newer (multishot recvmsg() and provided buffer rings).
+ * Not thread safe, only the owning worker may touch it.
+ */
+class UringIo {
+    public:
+    // what a completion belongs to, in the top byte of its user_data
+    enum Op : uint8_t {
+        RECV = 1,
+        SEND = 2,
+        POLL = 3,
+        CANCEL = 4
+    };
+
+    static constexpr uint64_t TAG_MASK = (1ULL << 56) - 1;
+
+    static uint64_t user_data(Op op, uint64_t tag) {
+        return (uint64_t)op << 56 | (tag & TAG_MASK);
+    }
+
+    static Op op_of(const io_uring_cqe& cqe) {
+        return (Op)(cqe.user_data >> 56);
+    }
+
+    static uint64_t tag_of(const io_uring_cqe& cqe) {
+        return cqe.user_data & TAG_MASK;
+    }
+
+    /**
+     * @brief
+     * Sets up the ring and registers the receive buffers, throws
+     * std::runtime_error if the kernel can't do either
+     *
+     * @param entries submission queue size, rounded up to a power of two by the kernel
+     * @param buffer_count receive buffers, rounded up to a power of two
+     * @param frame_size largest frame a buffer has to hold
+     */
+    UringIo(unsigned int entries, unsigned int buffer_count, unsigned int frame_size) {
+        io_uring_params params{};
+        // completions wait for the next kernel entry instead of interrupting the worker, flagged in the sq ring
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+        params.cq_entries = entries * 4; // every received frame completes on its own
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0 && errno == EINVAL) {
+            // COOP_TASKRUN and TASKRUN_FLAG are 5.19
+            params = io_uring_params{};
+            params.flags = IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            fd = syscall(__NR_io_uring_setup, entries, &params);
+        }
+        if (fd < 0) {
+            throw std::runtime_error(std::string("io_uring_setup: ") + strerror(errno));
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+            close(fd);
+            throw std::runtime_error("io_uring: kernel too old");
+        }
+
+        ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                             params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        void* addr = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            throw std::runtime_error(std::string("mmap io_uring: ") + strerror(err));
+        }
+        ring = (unsigned char*)addr;
+
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        addr = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            release_ring();
+            throw std::runtime_error(std::string("mmap io_uring sqes: ") + strerror(err));
+        }
+        sqes = (io_uring_sqe*)addr;
+
+        sq_entries = params.sq_entries;
+        sq_mask = *(uint32_t*)(ring + params.sq_off.ring_mask);
+        sq_head = (uint32_t*)(ring + params.sq_off.head);
+        sq_tail = (uint32_t*)(ring + params.sq_off.tail);
+        sq_flags = (uint32_t*)(ring + params.sq_off.flags);
+        uint32_t* sq_array = (uint32_t*)(ring + params.sq_off.array);
+        for (uint32_t i = 0; i < sq_entries; i++) {
+            sq_array[i] = i;
+        }
+        sqe_tail = *sq_tail;
+
+        cq_mask = *(uint32_t*)(ring + params.cq_off.ring_mask);
+        cq_head = (uint32_t*)(ring + params.cq_off.head);
+        cq_tail = (uint32_t*)(ring + params.cq_off.tail);
+        cqes = (io_uring_cqe*)(ring + params.cq_off.cqes);
+
+        setup_buffers(buffer_count, frame_size);
+    }
+
+    UringIo(const UringIo&) = delete;
+    UringIo& operator=(const UringIo&) = delete;
+
+    ~UringIo() {
+        if (buffers != nullptr) {
+            munmap(buffers, (size_t)buffer_count * buffer_size);
+        }
+        if (buf_ring != nullptr) {
+            munmap(buf_ring, buf_ring_size);
+        }
+        release_ring();
+    }
+
+    int get_fd() {
+        return fd;
+    }
+
+    /**
+     * @brief
+     * Keeps a recvmsg() armed on sockfd, every frame completes as a RECV
+     * with tag in a receive buffer until the completion without
+     * IORING_CQE_F_MORE (out of buffers, error or cancel)
+     *
+     * @param sockfd
+     * @param tag
+     * @return false if the submission queue is full even after submitting
+     */
+    bool receive_multishot(int sockfd, uint64_t tag) {
+        io_uring_sqe* sqe = get_sqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = sockfd;
+        sqe->addr = (uint64_t)&recv_msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->user_data = user_data(RECV, tag);
+        return true;
+    }
+
+    /**
+     * @brief keeps a poll for POLLIN armed on fd, completing as POLL with tag
+     */
+    bool poll_multishot(int fd, uint64_t tag) {
+        io_uring_sqe* sqe = get_sqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = user_data(POLL, tag);
+        return true;
+    }
+
+    /**
+     * @brief
+     * Queues a send() of frame, which has to stay valid until its SEND
+     * completion with tag. A full socket holds it back until there is room,
+     * the kernel waits for that instead of failing it with -EAGAIN.
+     *
+     * @param sockfd
+     * @param frame
+     * @param size
+     * @param tag
+     * @return false if the submission queue is full even after submitting
+     */
+    bool send(int sockfd, const unsigned char* frame, int size, uint64_t tag) {
+        io_uring_sqe* sqe = get_sqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = sockfd;
+        sqe->addr = (uint64_t)frame;
+        sqe->len = size;
+        sqe->user_data = user_data(SEND, tag);
+        return true;
+    }
+
+    /**
+     * @brief cancels the armed operation with user_data target, its last completion carries -ECANCELED
+     */
+    bool cancel(uint64_t target) {
+        io_uring_sqe* sqe = get_sqe();
+        if (sqe == nullptr) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = user_data(CANCEL, 0);
+        return true;
+    }
+
+    /**
+     * @brief
+     * Hands the queued submissions to the kernel and waits for wait
+     * completions, at most timeout_ms unless that is negative
+     *
+     * @param wait
+     * @param timeout_ms
+     * @return io_uring_enter() result, -1 with errno set on error or timeout (ETIME)
+     */
+    int submit_and_wait(unsigned int wait, int timeout_ms) {
+        unsigned int to_submit = sqe_tail - *sq_tail;
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+
+        unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+        if (wait && timeout_ms >= 0) {
+            __kernel_timespec ts{timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1'000'000};
+            io_uring_getevents_arg arg{};
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = (uint64_t)&ts;
+            return syscall(__NR_io_uring_enter, fd, to_submit, wait, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        }
+        return syscall(__NR_io_uring_enter, fd, to_submit, wait, flags, nullptr, 0);
+    }
+
+    /**
+     * @brief
+     * True if submit_and_wait() has something to do without waiting:
+     * queued submissions, or completions the kernel only posts on the next
+     * io_uring_enter() (deferred task work, an overflowed completion queue)
+     */
+    bool needs_enter() {
+        return sqe_tail != *sq_tail || (__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) & (IORING_SQ_TASKRUN | IORING_SQ_CQ_OVERFLOW));
+    }
+
+    /**
+     * @brief true if a completion is waiting to be read
+     */
+    bool has_completions() {
+        return *cq_head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    /**
+     * @brief
+     * Calls on_completion(const io_uring_cqe& cqe) for every completion
+     * there is, in order
+     *
+     * @param on_completion
+     * @return number of completions
+     */
+    template <typename F>
+    unsigned int for_each_completion(F&& on_completion) {
+        uint32_t head = *cq_head;
+        uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        for (uint32_t i = head; i != tail; i++) {
+            on_completion(cqes[i & cq_mask]);
+        }
+        __atomic_store_n(cq_head, tail, __ATOMIC_RELEASE);
+        return tail - head;
+    }
+
+    /**
+     * @brief
+     * The frame a RECV completion delivered, valid until its buffer is
+     * recycled
+     *
+     * @param cqe RECV completion with IORING_CQE_F_BUFFER set
+     * @param frame
+     * @param size
+     * @param vlan id of the tag the kernel took off, NO_VLAN if none
+     * @return false if the frame was larger than a buffer and got truncated
+     */
+    bool frame_of(const io_uring_cqe& cqe, unsigned char*& frame, int& size, uint16_t& vlan) {
+        unsigned char* buffer = buffer_of(buffer_id(cqe));
+        io_uring_recvmsg_out* out = (io_uring_recvmsg_out*)buffer;
+
+        // the kernel lays out header, name (none), control and payload back to back
+        msghdr msg{};
+        msg.msg_control = buffer + sizeof(io_uring_recvmsg_out);
+        msg.msg_controllen = out->controllen;
+        vlan = auxdata_vlan(&msg);
+
+        frame = buffer + sizeof(io_uring_recvmsg_out) + recv_msg.msg_controllen;
+        size = (int)out->payloadlen;
+        return !(out->flags & MSG_TRUNC);
+    }
+
+    /**
+     * @brief the receive buffer a RECV completion with IORING_CQE_F_BUFFER set used
+     */
+    static uint16_t buffer_id(const io_uring_cqe& cqe) {
+        return cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+
+    /**
+     * @brief hands a receive buffer back to the kernel
+     */
+    void recycle(uint16_t id) {
+        provide_buffer(id);
+        __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+    }
+
+    private:
+    static constexpr uint16_t BUFFER_GROUP = 0;
+
+    /**
+     * @brief room for one more submission, submitting what is queued if the queue is full
+     */
+    io_uring_sqe* get_sqe() {
+        if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            submit_and_wait(0, -1);
+            if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+                return nullptr;
+            }
+        }
+        io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+        memset(sqe, 0, sizeof(io_uring_sqe));
+        sqe_tail++;
+        return sqe;
+    }
+
+    void setup_buffers(unsigned int count, unsigned int frame_size) {
+        buffer_count = 1;
+        while (buffer_count < count) {
+            buffer_count <<= 1;
+        }
+        if (buffer_count > 1 << 15) {
+            buffer_count = 1 << 15;
+        }
+
+        // recvmsg() control space for the PACKET_AUXDATA of every frame
+        recv_msg.msg_controllen = AUXDATA_SPACE;
+        buffer_size = sizeof(io_uring_recvmsg_out) + AUXDATA_SPACE + frame_size;
+        buffer_size = (buffer_size + 63) & ~63u; // keeps the headers aligned, every buffer starts a cache line
+
+        buf_ring_size = (size_t)buffer_count * sizeof(io_uring_buf);
+        void* addr = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            release_ring();
+            throw std::runtime_error(std::string("mmap io_uring buffer ring: ") + strerror(err));
+        }
+        buf_ring = (io_uring_buf_ring*)addr;
+
+        addr = mmap(nullptr, (size_t)buffer_count * buffer_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            munmap(buf_ring, buf_ring_size);
+            release_ring();
+            throw std::runtime_error(std::string("mmap io_uring buffers: ") + strerror(err));
+        }
+        buffers = (unsigned char*)addr;
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)buf_ring;
+        reg.ring_entries = buffer_count;
+        reg.bgid = BUFFER_GROUP;
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            int err = errno;
+            munmap(buffers, (size_t)buffer_count * buffer_size);
+            munmap(buf_ring, buf_ring_size);
+            release_ring();
+            throw std::runtime_error(std::string("IORING_REGISTER_PBUF_RING: ") + strerror(err));
+        }
+
+        for (unsigned int i = 0; i < buffer_count; i++) {
+            provide_buffer(i);
+        }
+        __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+    }
+
+    unsigned char* buffer_of(uint16_t id) {
+        return buffers + (size_t)id * buffer_size;
+    }
+
+    void provide_buffer(uint16_t id) {
+        // not buf_ring->bufs, in C++ the empty struct __DECLARE_FLEX_ARRAY puts in front moves it 8 bytes
+        io_uring_buf& buf = ((io_uring_buf*)buf_ring)[buf_tail & (buffer_count - 1)];
+        buf.addr = (uint64_t)buffer_of(id);
+        buf.len = buffer_size;
+        buf.bid = id;
+        buf_tail++;
+    }
+
+    void release_ring() {
+        if (sqes != nullptr) {
+            munmap(sqes, sqes_size);
+        }
+        munmap(ring, ring_size);
+        close(fd);
+    }
+
+    int fd;
+    unsigned char* ring = nullptr;
+    size_t ring_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned int sq_entries;
+    uint32_t sq_mask;
+    uint32_t* sq_head;
+    uint32_t* sq_tail;
+    uint32_t* sq_flags;
+    uint32_t sqe_tail; // queued up to here, *sq_tail is what the kernel has seen
+
+    uint32_t cq_mask;
+    uint32_t* cq_head;
+    uint32_t* cq_tail;
+    io_uring_cqe* cqes;
+
+    msghdr recv_msg{}; // layout of the multishot receives, read by the kernel while they are armed
+    io_uring_buf_ring* buf_ring = nullptr;
+    size_t buf_ring_size = 0;
+    uint16_t buf_tail = 0;
+    unsigned char* buffers = nullptr;
+    unsigned int buffer_count = 0;
+    unsigned int buffer_size = 0;
+};
+
+#endif
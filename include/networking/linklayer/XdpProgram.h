@@ -0,0 +1,267 @@
+#ifndef XDP_PROGRAM_H
+#define XDP_PROGRAM_H
+
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @brief
+ * XDP program of a port, built instruction by instruction like the
+ * SocketFilter of its packet sockets and loaded with the raw bpf() calls.
+ * It drops what the socket filter would drop (group source macs, blocked
+ * macs and ethertypes) and redirects the rest to the AF_XDP socket of the
+ * rx queue through an XSKMAP. Queues without a socket in the map pass their
+ * frames on to the stack and so to the packet sockets.
+ *
+ * Attached through a bpf link, so it is detached when the link is closed,
+ * with the forwarder if it dies. Needs Linux 5.9 or newer.
+ */
+class XdpProgram {
+    public:
+    /**
+     * @brief
+     * Loads and attaches the program, throws std::runtime_error if the
+     * kernel can't do either
+     *
+     * @param ifindex
+     * @param queues rx queues of the interface, entries of the map
+     * @param generic attach in generic (SKB) mode, otherwise native mode is tried first
+     * @param blocked_macs
+     * @param blocked_ethertypes
+     */
+    XdpProgram(int ifindex, unsigned int queues, bool generic,
+        const std::vector<uint64_t>& blocked_macs, const std::vector<uint16_t>& blocked_ethertypes) {
+        bpf_attr attr{};
+        attr.map_type = BPF_MAP_TYPE_XSKMAP;
+        attr.key_size = sizeof(uint32_t);
+        attr.value_size = sizeof(uint32_t);
+        attr.max_entries = queues;
+        map_fd = bpf(BPF_MAP_CREATE, attr);
+        if (map_fd < 0) {
+            throw std::runtime_error(std::string("XSKMAP: ") + strerror(errno));
+        }
+
+        prog_fd = load(blocked_macs, blocked_ethertypes);
+        if (prog_fd < 0) {
+            int err = errno;
+            close(map_fd);
+            throw std::runtime_error(std::string("loading the XDP program: ") + strerror(err));
+        }
+
+        // native mode first, it runs before the kernel allocates an skb
+        this->generic = generic;
+        link_fd = generic ? -1 : attach(ifindex, XDP_FLAGS_DRV_MODE);
+        if (link_fd < 0) {
+            this->generic = true;
+            link_fd = attach(ifindex, XDP_FLAGS_SKB_MODE);
+        }
+        if (link_fd < 0) {
+            int err = errno;
+            close(prog_fd);
+            close(map_fd);
+            throw std::runtime_error(std::string("attaching the XDP program: ") + strerror(err));
+        }
+    }
+
+    XdpProgram(const XdpProgram&) = delete;
+    XdpProgram& operator=(const XdpProgram&) = delete;
+
+    ~XdpProgram() {
+        close(link_fd);
+        close(prog_fd);
+        close(map_fd);
+    }
+
+    /**
+     * @brief true if the program runs in generic (SKB) mode
+     */
+    bool is_generic() {
+        return generic;
+    }
+
+    /**
+     * @brief
+     * Redirects the frames of queue to the AF_XDP socket xsk_fd from now on,
+     * thread safe
+     *
+     * @param queue
+     * @param xsk_fd bound AF_XDP socket
+     * @return false with errno set on failure
+     */
+    bool insert(uint32_t queue, int xsk_fd) {
+        uint32_t value = xsk_fd;
+        bpf_attr attr{};
+        attr.map_fd = map_fd;
+        attr.key = (uint64_t)&queue;
+        attr.value = (uint64_t)&value;
+        return bpf(BPF_MAP_UPDATE_ELEM, attr) == 0;
+    }
+
+    /**
+     * @brief
+     * Takes the AF_XDP socket of queue out of the map, its frames go to the
+     * stack again. The map holds a reference to the socket, closing it only
+     * releases it once it is out (thread safe)
+     *
+     * @param queue
+     * @return false with errno set on failure
+     */
+    bool remove(uint32_t queue) {
+        bpf_attr attr{};
+        attr.map_fd = map_fd;
+        attr.key = (uint64_t)&queue;
+        return bpf(BPF_MAP_DELETE_ELEM, attr) == 0;
+    }
+
+    /**
+     * @brief
+     * Swaps in a program dropping the new blocked macs and ethertypes, frames
+     * keep their sockets
+     *
+     * @param blocked_macs
+     * @param blocked_ethertypes
+     * @return false with errno set if the kernel refused the program
+     */
+    bool update_filter(const std::vector<uint64_t>& blocked_macs, const std::vector<uint16_t>& blocked_ethertypes) {
+        int new_fd = load(blocked_macs, blocked_ethertypes);
+        if (new_fd < 0) {
+            return false;
+        }
+        bpf_attr attr{};
+        attr.link_update.link_fd = link_fd;
+        attr.link_update.new_prog_fd = new_fd;
+        if (bpf(BPF_LINK_UPDATE, attr) < 0) {
+            int err = errno;
+            close(new_fd);
+            errno = err;
+            return false;
+        }
+        close(prog_fd);
+        prog_fd = new_fd;
+        return true;
+    }
+
+    private:
+    // xdp_md fields, the context the program gets in r1
+    static constexpr int16_t CTX_DATA = 0;
+    static constexpr int16_t CTX_DATA_END = 4;
+    static constexpr int16_t CTX_RX_QUEUE_INDEX = 16;
+
+    static int bpf(int cmd, bpf_attr& attr) {
+        return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+    }
+
+    int attach(int ifindex, uint32_t flags) {
+        bpf_attr attr{};
+        attr.link_create.prog_fd = prog_fd;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = flags;
+        return bpf(BPF_LINK_CREATE, attr);
+    }
+
+    int load(const std::vector<uint64_t>& blocked_macs, const std::vector<uint16_t>& blocked_ethertypes) {
+        program.clear();
+
+        // r6 = ctx, r2 = data, r3 = data_end
+        emit(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0);
+        emit(BPF_LDX | BPF_MEM | BPF_W, 2, 6, CTX_DATA, 0);
+        emit(BPF_LDX | BPF_MEM | BPF_W, 3, 6, CTX_DATA_END, 0);
+
+        // runts, the switch drops them as well, and the bounds check for every load below
+        emit(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0);
+        emit(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, 14);
+        emit(BPF_JMP | BPF_JLE | BPF_X, 4, 3, 2, 0);
+        drop();
+
+        // group bit of the source mac
+        emit(BPF_LDX | BPF_MEM | BPF_B, 4, 2, 6, 0);
+        emit(BPF_ALU | BPF_AND | BPF_K, 4, 0, 0, 1);
+        emit(BPF_JMP32 | BPF_JEQ | BPF_K, 4, 0, 2, 0);
+        drop();
+
+        for (uint64_t mac: blocked_macs) {
+            match_mac(0, mac); // destination
+            match_mac(6, mac); // source
+        }
+
+        if (!blocked_ethertypes.empty()) {
+            emit(BPF_LDX | BPF_MEM | BPF_H, 4, 2, 12, 0);
+            for (uint16_t ethertype: blocked_ethertypes) {
+                unsigned char bytes[2] = {(unsigned char)(ethertype >> 8), (unsigned char)ethertype};
+                uint16_t value;
+                memcpy(&value, bytes, sizeof(value));
+                emit(BPF_JMP32 | BPF_JNE | BPF_K, 4, 0, 2, value);
+                drop();
+            }
+        }
+
+        // return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS)
+        emit(BPF_LDX | BPF_MEM | BPF_W, 2, 6, CTX_RX_QUEUE_INDEX, 0);
+        emit(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+        emit(0, 0, 0, 0, 0);
+        emit(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS);
+        emit(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+        emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+        static const char license[] = "GPL";
+        bpf_attr attr{};
+        attr.prog_type = BPF_PROG_TYPE_XDP;
+        attr.expected_attach_type = BPF_XDP;
+        attr.insns = (uint64_t)program.data();
+        attr.insn_cnt = program.size();
+        attr.license = (uint64_t)license;
+        return bpf(BPF_PROG_LOAD, attr);
+    }
+
+    void emit(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+        bpf_insn insn{};
+        insn.code = code;
+        insn.dst_reg = dst;
+        insn.src_reg = src;
+        insn.off = off;
+        insn.imm = imm;
+        program.push_back(insn);
+    }
+
+    void drop() {
+        emit(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_DROP);
+        emit(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+    }
+
+    /**
+     * @brief drops the frame if the 6 bytes at offset are mac (loads are in host byte order)
+     */
+    void match_mac(int16_t offset, uint64_t mac) {
+        unsigned char bytes[6];
+        for (int i = 0; i < 6; i++) {
+            bytes[i] = mac >> (40 - 8*i);
+        }
+        uint32_t high;
+        uint16_t low;
+        memcpy(&high, bytes, sizeof(high));
+        memcpy(&low, bytes + 4, sizeof(low));
+
+        emit(BPF_LDX | BPF_MEM | BPF_W, 4, 2, offset, 0);
+        emit(BPF_JMP32 | BPF_JNE | BPF_K, 4, 0, 4, (int32_t)high);
+        emit(BPF_LDX | BPF_MEM | BPF_H, 4, 2, offset + 4, 0);
+        emit(BPF_JMP32 | BPF_JNE | BPF_K, 4, 0, 2, low);
+        drop();
+    }
+
+    int map_fd = -1;
+    int prog_fd = -1;
+    int link_fd = -1;
+    bool generic = false;
+    std::vector<bpf_insn> program;
+};
+
+#endif
@@ -0,0 +1,561 @@
+#ifndef XDP_SOCKET_H
+#define XDP_SOCKET_H
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/bpf.h>
+#include <linux/if_xdp.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class XdpSocket;
+
+/**
+ * @brief
+ * Frame memory of one worker's AF_XDP sockets, shared by all of them so a
+ * frame received on one port is sent on another from the same chunk.
+ * Chunks are counted references: one for a received frame until its batch
+ * is forwarded, one per tx ring it sits in. Chunks in fill rings belong to
+ * the kernel and are counted by no one, the socket that handed them over
+ * keeps track of them until they come back on its rx ring.
+ *
+ * Only the owning worker allocates and releases chunks. Sockets closed on
+ * the control path hand theirs back through give_back(), the worker picks
+ * them up with its next refill.
+ */
+class XdpUmem {
+    public:
+    /**
+     * @brief
+     * Maps frame_count chunks of 2048 bytes, or 4096 if frames are larger,
+     * throws std::runtime_error if the frames don't fit a page or on failure
+     *
+     * @param frame_count
+     * @param frame_size largest frame a chunk has to hold
+     */
+    XdpUmem(unsigned int frame_count, unsigned int frame_size) {
+        chunk_shift = frame_size + XDP_PACKET_HEADROOM <= 2048 ? 11 : 12;
+        if (frame_size + XDP_PACKET_HEADROOM > 1u << chunk_shift) {
+            throw std::runtime_error("frames of " + std::to_string(frame_size) + " bytes don't fit an AF_XDP chunk");
+        }
+
+        size = (size_t)frame_count << chunk_shift;
+        void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error(std::string("mmap umem: ") + strerror(errno));
+        }
+        area = (unsigned char*)addr;
+
+        refs.resize(frame_count);
+        free_frames.reserve(frame_count);
+        for (unsigned int i = frame_count; i > 0; i--) {
+            free_frames.push_back((uint64_t)(i - 1) << chunk_shift);
+        }
+    }
+
+    XdpUmem(const XdpUmem&) = delete;
+    XdpUmem& operator=(const XdpUmem&) = delete;
+
+    ~XdpUmem() {
+        munmap(area, size);
+    }
+
+    unsigned char* get_area() {
+        return area;
+    }
+
+    size_t get_size() {
+        return size;
+    }
+
+    unsigned int get_chunk_size() {
+        return 1u << chunk_shift;
+    }
+
+    unsigned char* data(uint64_t addr) {
+        return area + addr;
+    }
+
+    bool contains(const unsigned char* frame) {
+        return frame >= area && frame < area + size;
+    }
+
+    uint64_t address(const unsigned char* frame) {
+        return frame - area;
+    }
+
+    size_t chunk_count() {
+        return refs.size();
+    }
+
+    /**
+     * @brief index of the chunk addr points into, received frames start past its headroom
+     */
+    size_t chunk_of(uint64_t addr) {
+        return addr >> chunk_shift;
+    }
+
+    /**
+     * @brief takes a free chunk, unreferenced
+     *
+     * @param addr
+     * @return false if none is left
+     */
+    bool allocate(uint64_t& addr) {
+        if (free_frames.empty()) {
+            return false;
+        }
+        addr = free_frames.back();
+        free_frames.pop_back();
+        return true;
+    }
+
+    void retain(uint64_t addr) {
+        refs[addr >> chunk_shift]++;
+    }
+
+    /**
+     * @brief drops a reference, the chunk is free again after the last one
+     */
+    void release(uint64_t addr) {
+        uint64_t chunk = addr >> chunk_shift;
+        if (--refs[chunk] == 0) {
+            free_frames.push_back(chunk << chunk_shift);
+        }
+    }
+
+    /**
+     * @brief
+     * Chunks of a closed socket (control path): unused ones were in its fill
+     * or rx ring, sent ones in its tx or completion ring and hold a reference
+     *
+     * @param unused
+     * @param sent
+     */
+    void give_back(const std::vector<uint64_t>& unused, const std::vector<uint64_t>& sent) {
+        returned_m.lock();
+        returned_unused.insert(returned_unused.end(), unused.begin(), unused.end());
+        returned_sent.insert(returned_sent.end(), sent.begin(), sent.end());
+        has_returned.store(true);
+        returned_m.unlock();
+    }
+
+    /**
+     * @brief frees what give_back() handed over (worker only)
+     */
+    void take_returned() {
+        if (!has_returned.load(std::memory_order_relaxed) || !returned_m.try_lock()) {
+            return;
+        }
+        for (uint64_t addr: returned_unused) {
+            free_frames.push_back(addr >> chunk_shift << chunk_shift);
+        }
+        for (uint64_t addr: returned_sent) {
+            release(addr);
+        }
+        returned_unused.clear();
+        returned_sent.clear();
+        has_returned.store(false);
+        returned_m.unlock();
+    }
+
+    // the socket the umem is registered with, that later ones share it through (control path)
+    XdpSocket* owner = nullptr;
+
+    private:
+    unsigned char* area;
+    size_t size;
+    unsigned int chunk_shift;
+    std::vector<uint16_t> refs; // by chunk
+    std::vector<uint64_t> free_frames;
+
+    std::mutex returned_m;
+    std::atomic<bool> has_returned{false};
+    std::vector<uint64_t> returned_unused;
+    std::vector<uint64_t> returned_sent;
+};
+
+/**
+ * @brief
+ * AF_XDP socket on one rx queue of a port with its own rx, tx, fill and
+ * completion rings over a worker's XdpUmem. The first socket of a umem
+ * registers it, the others share it. Zero-copy is used where the driver
+ * offers it, copy mode otherwise.
+ *
+ * Received frames are read in place from the umem. Frames queued for
+ * sending go to the kernel together with flush(), frames already in the
+ * umem without a copy.
+ *
+ * Needs Linux 5.10 or newer (umem shared across devices). Not thread safe,
+ * only the owning worker may touch it after it is set up.
+ */
+class XdpSocket {
+    public:
+    static constexpr uint32_t RING_SIZE = 512;
+    // chunks a socket holds for receiving, so one port can't take a whole umem
+    static constexpr uint32_t FILL_SIZE = 256;
+
+    /**
+     * @brief
+     * Binds to queue of ifindex, throws std::runtime_error on failure
+     *
+     * @param ifindex
+     * @param queue
+     * @param umem
+     * @param zerocopy try zero-copy before copy mode
+     */
+    XdpSocket(int ifindex, uint32_t queue, XdpUmem* umem, bool zerocopy) {
+        this->umem = umem;
+        with_kernel.resize(umem->chunk_count());
+        fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error(std::string("AF_XDP socket: ") + strerror(errno));
+        }
+
+        try {
+            set_ring(XDP_UMEM_FILL_RING, FILL_SIZE);
+            set_ring(XDP_UMEM_COMPLETION_RING, RING_SIZE);
+            set_ring(XDP_RX_RING, RING_SIZE);
+            set_ring(XDP_TX_RING, RING_SIZE);
+
+            xdp_mmap_offsets offsets{};
+            socklen_t length = sizeof(offsets);
+            if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &length) == -1) {
+                throw std::runtime_error(std::string("XDP_MMAP_OFFSETS: ") + strerror(errno));
+            }
+            map_ring(fill, offsets.fr, FILL_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING);
+            map_ring(completion, offsets.cr, RING_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING);
+            map_ring(rx, offsets.rx, RING_SIZE, sizeof(xdp_desc), XDP_PGOFF_RX_RING);
+            map_ring(tx, offsets.tx, RING_SIZE, sizeof(xdp_desc), XDP_PGOFF_TX_RING);
+
+            // share the umem while its owner is bound, register it again otherwise
+            bool bound = umem->owner != nullptr && bind_queue(ifindex, queue, XDP_SHARED_UMEM, zerocopy);
+            if (!bound) {
+                xdp_umem_reg reg{};
+                reg.addr = (uint64_t)umem->get_area();
+                reg.len = umem->get_size();
+                reg.chunk_size = umem->get_chunk_size();
+                if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) {
+                    throw std::runtime_error(std::string("XDP_UMEM_REG: ") + strerror(errno));
+                }
+                if (!bind_queue(ifindex, queue, 0, zerocopy)) {
+                    throw std::runtime_error(std::string("binding AF_XDP socket: ") + strerror(errno));
+                }
+                umem->owner = this;
+            }
+        } catch (std::runtime_error&) {
+            unmap_rings();
+            close(fd);
+            throw;
+        }
+    }
+
+    XdpSocket(const XdpSocket&) = delete;
+    XdpSocket& operator=(const XdpSocket&) = delete;
+
+    /**
+     * @brief
+     * Closes the socket and hands its chunks back to the umem. It has to be
+     * out of the XSKMAP by then, the map keeps it open otherwise (control path).
+     */
+    ~XdpSocket() {
+        close(fd);
+        if (umem->owner == this) {
+            umem->owner = nullptr;
+        }
+
+        // the rings stay mapped after close, whatever sits in them is done with. Chunks
+        // handed to the fill ring and not received are unused, whether they still sit
+        // there, the driver took them or they wait on the rx ring.
+        std::vector<uint64_t> unused;
+        std::vector<uint64_t> sent;
+        for (size_t chunk = 0; chunk < with_kernel.size(); chunk++) {
+            if (with_kernel[chunk]) {
+                unused.push_back((uint64_t)chunk * umem->get_chunk_size());
+            }
+        }
+        for (uint32_t i = *tx.consumer; i != tx_producer; i++) {
+            sent.push_back(((xdp_desc*)tx.ring)[i & tx.mask].addr);
+        }
+        for (uint32_t i = *completion.consumer; i != *completion.producer; i++) {
+            sent.push_back(((uint64_t*)completion.ring)[i & completion.mask]);
+        }
+        umem->give_back(unused, sent);
+        unmap_rings();
+    }
+
+    int get_fd() {
+        return fd;
+    }
+
+    bool is_zerocopy() {
+        return zerocopy;
+    }
+
+    /**
+     * @brief
+     * Calls on_frame(unsigned char* frame, int size) for up to max received
+     * frames, which stay valid until on_done() returns, then gives the rx
+     * ring slots back. The chunks go back to the fill ring with refill().
+     *
+     * @param max
+     * @param on_frame
+     * @param on_done
+     * @return number of frames
+     */
+    template <typename F, typename D>
+    unsigned int receive_batch(unsigned int max, F&& on_frame, D&& on_done) {
+        uint32_t available = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE) - rx_consumer;
+        unsigned int count = std::min<uint32_t>(available, max);
+        xdp_desc* descs = (xdp_desc*)rx.ring;
+
+        for (unsigned int i = 0; i < count; i++) {
+            xdp_desc& desc = descs[(rx_consumer + i) & rx.mask];
+            with_kernel[umem->chunk_of(desc.addr)] = false;
+            umem->retain(desc.addr);
+            on_frame(umem->data(desc.addr), (int)desc.len);
+        }
+        if (count > 0) {
+            on_done();
+        }
+        for (unsigned int i = 0; i < count; i++) {
+            umem->release(descs[(rx_consumer + i) & rx.mask].addr);
+        }
+        rx_consumer += count;
+        __atomic_store_n(rx.consumer, rx_consumer, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    /**
+     * @brief
+     * Tops the fill ring up from the free chunks of the umem
+     *
+     * @return true if the driver had to be woken with a syscall
+     */
+    bool refill() {
+        umem->take_returned();
+        uint32_t room = FILL_SIZE - (fill_producer - __atomic_load_n(fill.consumer, __ATOMIC_ACQUIRE));
+        uint64_t addr;
+        uint32_t filled = 0;
+        while (filled < room && umem->allocate(addr)) {
+            ((uint64_t*)fill.ring)[fill_producer++ & fill.mask] = addr;
+            with_kernel[umem->chunk_of(addr)] = true;
+            filled++;
+        }
+        if (filled > 0) {
+            __atomic_store_n(fill.producer, fill_producer, __ATOMIC_RELEASE);
+        }
+        if (__atomic_load_n(fill.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP) {
+            recvfrom(fd, nullptr, 0, MSG_DONTWAIT, nullptr, nullptr);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief
+     * Queues a frame on the tx ring, without a copy if it is in the umem
+     * already. Nothing is sent until flush().
+     *
+     * @param data
+     * @param size
+     * @return false if the ring is full, no chunk is free or the frame doesn't fit one
+     */
+    bool queue_frame(const unsigned char* data, int size) {
+        if (tx_producer - __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE) >= RING_SIZE
+            || (unsigned int)size + XDP_PACKET_HEADROOM > umem->get_chunk_size()) {
+            return false;
+        }
+
+        uint64_t addr;
+        if (umem->contains(data)) {
+            addr = umem->address(data);
+        }
+        else {
+            if (!umem->allocate(addr)) {
+                complete();
+                if (!umem->allocate(addr)) {
+                    return false;
+                }
+            }
+            memcpy(umem->data(addr), data, size);
+        }
+        umem->retain(addr);
+
+        xdp_desc& desc = ((xdp_desc*)tx.ring)[tx_producer++ & tx.mask];
+        desc.addr = addr;
+        desc.len = size;
+        desc.options = 0;
+        tx_pending++;
+        return true;
+    }
+
+    /**
+     * @brief
+     * Hands the queued frames to the kernel, kicking it with sendto() as
+     * often as it asks for (copy mode sends a limited number per call), and
+     * frees the chunks of completed sends
+     *
+     * @param syscalls incremented per sendto()
+     * @return 0, or -1 with errno set if the kernel refused to send. Frames it
+     * had no room for (EAGAIN, ENOBUFS, EBUSY) stay queued for the next flush.
+     */
+    int flush(unsigned int& syscalls) {
+        int r = 0;
+        if (tx_pending > 0) {
+            tx_pending = 0;
+            __atomic_store_n(tx.producer, tx_producer, __ATOMIC_RELEASE);
+
+            for (uint32_t kicks = 0; kicks <= RING_SIZE / 16; kicks++) {
+                if (__atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE) == tx_producer
+                    || !(__atomic_load_n(tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP)) {
+                    break;
+                }
+                r = sendto(fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+                syscalls++;
+                if (r < 0 && errno == ENOBUFS) {
+                    complete(); // completion ring full
+                }
+                else if (r < 0 && errno != EAGAIN) {
+                    break;
+                }
+            }
+            if (r < 0 && (errno == EAGAIN || errno == ENOBUFS || errno == EBUSY)) {
+                uint32_t left = tx_producer - __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE);
+                if (left == 0) {
+                    r = 0;
+                }
+                else {
+                    tx_pending = left; // nothing else kicks the kernel for them
+                }
+            }
+        }
+        int err = errno;
+        complete();
+        errno = err;
+        return r;
+    }
+
+    /**
+     * @brief frames on the tx ring the kernel has not completed yet
+     */
+    uint32_t in_flight() {
+        return tx_producer - completion_consumer;
+    }
+
+    /**
+     * @brief frees the chunks of the sends the kernel is done with
+     */
+    void complete() {
+        uint32_t producer = __atomic_load_n(completion.producer, __ATOMIC_ACQUIRE);
+        for (; completion_consumer != producer; completion_consumer++) {
+            umem->release(((uint64_t*)completion.ring)[completion_consumer & completion.mask]);
+        }
+        __atomic_store_n(completion.consumer, completion_consumer, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * @brief frames the kernel dropped on this socket so far, full rx ring or no fill chunk
+     * (rx_dropped counts the latter, rx_fill_ring_empty_descs counts them again)
+     */
+    uint64_t get_dropped() {
+        xdp_statistics stats{};
+        socklen_t length = sizeof(stats);
+        if (getsockopt(fd, SOL_XDP, XDP_STATISTICS, &stats, &length) == -1) {
+            return 0;
+        }
+        return stats.rx_dropped + stats.rx_ring_full;
+    }
+
+    private:
+    struct Ring {
+        uint32_t* producer = nullptr;
+        uint32_t* consumer = nullptr;
+        uint32_t* flags = nullptr;
+        void* ring = nullptr;
+        uint32_t mask = 0;
+        void* map = nullptr;
+        size_t map_size = 0;
+    };
+
+    void set_ring(int option, uint32_t size) {
+        if (setsockopt(fd, SOL_XDP, option, &size, sizeof(size)) == -1) {
+            throw std::runtime_error(std::string("AF_XDP ring: ") + strerror(errno));
+        }
+    }
+
+    void map_ring(Ring& ring, const xdp_ring_offset& offset, uint32_t size, size_t entry_size, off_t pgoff) {
+        ring.map_size = offset.desc + size * entry_size;
+        void* addr = mmap(nullptr, ring.map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+        if (addr == MAP_FAILED) {
+            throw std::runtime_error(std::string("mmap AF_XDP ring: ") + strerror(errno));
+        }
+        unsigned char* base = (unsigned char*)addr;
+        ring.map = addr;
+        ring.producer = (uint32_t*)(base + offset.producer);
+        ring.consumer = (uint32_t*)(base + offset.consumer);
+        ring.flags = (uint32_t*)(base + offset.flags);
+        ring.ring = base + offset.desc;
+        ring.mask = size - 1;
+    }
+
+    void unmap_rings() {
+        for (Ring* ring: {&fill, &completion, &rx, &tx}) {
+            if (ring->map != nullptr) {
+                munmap(ring->map, ring->map_size);
+            }
+        }
+    }
+
+    /**
+     * @brief binds zero-copy if asked and possible, in copy mode otherwise
+     */
+    bool bind_queue(int ifindex, uint32_t queue, uint16_t flags, bool try_zerocopy) {
+        sockaddr_xdp addr{};
+        addr.sxdp_family = AF_XDP;
+        addr.sxdp_ifindex = ifindex;
+        addr.sxdp_queue_id = queue;
+        addr.sxdp_flags = flags | XDP_USE_NEED_WAKEUP;
+        if (flags & XDP_SHARED_UMEM) {
+            addr.sxdp_shared_umem_fd = umem->owner->get_fd();
+        }
+
+        if (try_zerocopy) {
+            addr.sxdp_flags |= XDP_ZEROCOPY;
+            if (bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+                zerocopy = true;
+                return true;
+            }
+            addr.sxdp_flags &= ~XDP_ZEROCOPY;
+        }
+        addr.sxdp_flags |= XDP_COPY;
+        return bind(fd, (sockaddr*)&addr, sizeof(addr)) == 0;
+    }
+
+    int fd;
+    XdpUmem* umem;
+    bool zerocopy = false;
+
+    Ring fill;
+    Ring completion;
+    Ring rx;
+    Ring tx;
+    // local ends of the rings, published to the kernel with release stores
+    uint32_t fill_producer = 0;
+    uint32_t completion_consumer = 0;
+    uint32_t rx_consumer = 0;
+    uint32_t tx_producer = 0;
+    uint32_t tx_pending = 0;
+    // by umem chunk, handed to the fill ring and not received yet
+    std::vector<bool> with_kernel;
+};
+
+#endif
@@ -5,7 +5,11 @@
 #include <string>
 #include <iomanip>
 #include <string_utils.h>
+#include <cstring>
+#include <endian.h>
 #include <net/ethernet.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
 
 uint64_t pack_mac_str(std::string mac) {
     uint64_t result = 0;
@@ -53,14 +57,20 @@ std::vector<unsigned char> mac_str_to_bytes(std::string mac_str) {
     return bytes;
 }
 
+/**
+ * @brief
+ * The 6 bytes at unpacked as a 48 bit big endian number, loaded as one 32
+ * and one 16 bit word instead of byte by byte
+ *
+ * @param unpacked
+ * @return uint64_t
+ */
 uint64_t pack_mac_bytes(const unsigned char* unpacked) {
-    uint64_t packed = 0;
-
-    for (int i = 0; i < 6; i++) {
-        packed |= static_cast<uint64_t>(unpacked[i]) << (40 - 8*i);
-    }
-
-    return packed;
+    uint32_t hi;
+    uint16_t lo;
+    memcpy(&hi, unpacked, sizeof(hi));
+    memcpy(&lo, unpacked + sizeof(hi), sizeof(lo));
+    return (uint64_t)be32toh(hi) << 16 | be16toh(lo);
 }
 
 std::vector<unsigned char> unpack_mac_bytes(uint64_t packed) {
@@ -78,5 +88,28 @@ uint64_t get_src_mac(unsigned char* frame) {
     return pack_mac_bytes(header->ether_shost); 
 }
 
+constexpr uint16_t NO_VLAN = 0xFFFF; // the frame had no 802.1Q tag
+
+// room for the PACKET_AUXDATA control message of one frame
+constexpr size_t AUXDATA_SPACE = CMSG_SPACE(sizeof(tpacket_auxdata));
+
+/**
+ * @brief
+ * The kernel takes the 802.1Q tag off received frames before packet sockets
+ * see them, with PACKET_AUXDATA enabled it comes back as a control message
+ *
+ * @param msg a received message
+ * @return vlan id of the tag, NO_VLAN if the frame had none
+ */
+uint16_t auxdata_vlan(msghdr* msg) {
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_AUXDATA) {
+            tpacket_auxdata* aux = (tpacket_auxdata*)CMSG_DATA(cmsg);
+            return aux->tp_status & TP_STATUS_VLAN_VALID ? aux->tp_vlan_tci & 0x0FFF : NO_VLAN;
+        }
+    }
+    return NO_VLAN;
+}
+
 #endif
 
@@ -1,12 +1,23 @@
 #include <networking/PacketHandler.h>
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
-        std::cerr << "Usage: forwarder <abstract forwarder address>" << std::endl;
+    if (argc != 2 && argc != 3) {
+        std::cerr << "Usage: forwarder <abstract forwarder address> [config file]" << std::endl;
         return 1;
     }
 
-    PacketHandler packetHandler;
+    ForwarderConfig config;
+
+    if (argc == 3) {
+        try {
+            config = ForwarderConfig(argv[2]);
+        } catch (std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    PacketHandler packetHandler(config);
     packetHandler.run(argv[1]);
 
     return 1;
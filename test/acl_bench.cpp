@@ -0,0 +1,177 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+#include <networking/linklayer/Acl.h>
+#include <networking/linklayer/time_utils.h>
+#include <string_utils.h>
+
+using cpp_utils::string_utils::convert_string;
+
+/**
+ * Per frame cost of the compiled acl against a linear scan of the same
+ * rules, for 10, 100 and 1000 rules over 8 ports. Rules mix a few field
+ * combinations the way real rule sets do (per host, per protocol, per vlan),
+ * about a quarter of the frames match a rule. Both have to pick the same
+ * rule for every frame.
+ */
+
+constexpr uint16_t PORTS = 8;
+
+struct Frame {
+    uint16_t in_port;
+    unsigned char data[64];
+    FrameKeys keys;
+};
+
+uint64_t random_mac(std::mt19937_64& rng) {
+    return (rng() & 0x0000FEFFFFFFFFFFULL) | 0x020000000000ULL;
+}
+
+void put_mac(unsigned char* at, uint64_t mac) {
+    std::vector<unsigned char> bytes = unpack_mac_bytes(mac);
+    std::copy(bytes.begin(), bytes.end(), at);
+}
+
+std::string mac_text(uint64_t mac) {
+    return mac_to_str(unpack_mac_bytes(mac).data());
+}
+
+std::vector<AclRule> make_rules(unsigned int count, std::mt19937_64& rng, std::vector<uint64_t>& macs) {
+    std::vector<AclRule> rules;
+    for (unsigned int i = 0; i < count; i++) {
+        uint64_t mac = random_mac(rng);
+        macs.push_back(mac);
+        std::string port = rng() % 2 ? "port" + std::to_string(rng() % PORTS) : "any";
+        std::vector<std::string> tokens{"acl", port, rng() % 4 ? "deny" : "permit"};
+        switch (i % 4) {
+            case 0:
+                tokens.insert(tokens.end(), {"src", mac_text(mac)});
+                break;
+            case 1:
+                tokens.insert(tokens.end(), {"dst", mac_text(mac)});
+                break;
+            case 2:
+                tokens.insert(tokens.end(), {"dst", mac_text(mac), "ethertype", "0x0800"});
+                break;
+            default:
+                tokens.insert(tokens.end(), {"src", mac_text(mac), "vlan", std::to_string(rng() % 4096)});
+                break;
+        }
+        rules.push_back(AclRule::parse(tokens));
+    }
+    return rules;
+}
+
+std::vector<Frame> make_frames(unsigned int count, std::mt19937_64& rng, const std::vector<uint64_t>& rule_macs) {
+    std::vector<Frame> frames(count);
+    for (Frame& frame: frames) {
+        frame.in_port = rng() % PORTS;
+        std::fill(std::begin(frame.data), std::end(frame.data), 0);
+        bool hit = rng() % 4 == 0;
+        put_mac(frame.data, hit && rng() % 2 ? rule_macs[rng() % rule_macs.size()] : random_mac(rng));
+        put_mac(frame.data + 6, hit ? rule_macs[rng() % rule_macs.size()] : random_mac(rng));
+        frame.data[12] = 0x08;
+        frame.data[13] = 0x00;
+        const unsigned char* header = frame.data;
+        classify_headers(&header, 1, &frame.keys);
+    }
+    return frames;
+}
+
+/**
+ * @brief the rule set read top to bottom, the way a naive acl would
+ */
+uint32_t linear_match(const std::vector<AclRule>& rules, const std::vector<uint16_t>& rule_ports, const Frame& frame) {
+    uint64_t dst = pack_mac_bytes(frame.data);
+    uint64_t src = pack_mac_bytes(frame.data + 6);
+    uint16_t ethertype = frame.data[12] << 8 | frame.data[13];
+    int vlan = -1;
+    if (ethertype == ETHERTYPE_VLAN || ethertype == 0x88A8) {
+        vlan = (frame.data[14] << 8 | frame.data[15]) & 0x0FFF;
+        ethertype = frame.data[16] << 8 | frame.data[17];
+    }
+    for (uint32_t i = 0; i < rules.size(); i++) {
+        const AclRule& rule = rules[i];
+        if ((rule.fields & AclRule::PORT && rule_ports[i] != frame.in_port)
+            || (rule.fields & AclRule::SRC && rule.src != src)
+            || (rule.fields & AclRule::DST && rule.dst != dst)
+            || (rule.fields & AclRule::ETHERTYPE && rule.ethertype != ethertype)
+            || (rule.fields & AclRule::VLAN && rule.vlan != vlan)) {
+            continue;
+        }
+        return i;
+    }
+    return Acl::NO_RULE;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 2) {
+        std::cerr << "Usage: ./acl_bench [passes]" << std::endl;
+        return 0;
+    }
+
+    unsigned int passes = argc > 1 ? convert_string<unsigned int>(argv[1]) : 20;
+
+    std::unordered_map<std::string, uint16_t> port_ids;
+    for (uint16_t p = 0; p < PORTS; p++) {
+        port_ids.insert({"port" + std::to_string(p), p});
+    }
+
+    std::cout << std::setw(8) << "rules" << std::setw(8) << "groups" << std::setw(12) << "matched"
+        << std::setw(16) << "compiled ns" << std::setw(14) << "linear ns" << std::endl;
+
+    for (unsigned int count: {10, 100, 1000}) {
+        std::mt19937_64 rng(count);
+        std::vector<uint64_t> rule_macs;
+        std::vector<AclRule> rules = make_rules(count, rng, rule_macs);
+        std::vector<Frame> frames = make_frames(1 << 16, rng, rule_macs);
+
+        std::vector<uint16_t> rule_ports;
+        for (AclRule& rule: rules) {
+            rule_ports.push_back(rule.fields & AclRule::PORT ? port_ids.at(rule.ifname) : 0);
+        }
+
+        Acl acl(rules, port_ids, 1);
+
+        uint64_t matched = 0;
+        for (Frame& frame: frames) {
+            uint32_t rule = acl.match(frame.in_port, NO_VLAN, frame.keys, frame.data, sizeof(frame.data));
+            if (rule != linear_match(rules, rule_ports, frame)) {
+                std::cerr << "mismatch with " << count << " rules" << std::endl;
+                return 1;
+            }
+            matched += rule != Acl::NO_RULE;
+        }
+
+        uint64_t denied = 0;
+        uint64_t start_ns = now_ns_monotonic();
+        for (unsigned int pass = 0; pass < passes; pass++) {
+            for (Frame& frame: frames) {
+                denied += acl.evaluate(0, frame.in_port, NO_VLAN, frame.keys, frame.data, sizeof(frame.data)) == AclAction::DENY;
+            }
+        }
+        double compiled_ns = (double)(now_ns_monotonic() - start_ns) / passes / frames.size();
+
+        uint64_t linear_hits = 0;
+        start_ns = now_ns_monotonic();
+        for (unsigned int pass = 0; pass < passes; pass++) {
+            for (Frame& frame: frames) {
+                linear_hits += linear_match(rules, rule_ports, frame) != Acl::NO_RULE;
+            }
+        }
+        double linear_ns = (double)(now_ns_monotonic() - start_ns) / passes / frames.size();
+
+        if (denied == 0 || linear_hits == 0) {
+            std::cerr << "no rule matched" << std::endl;
+        }
+
+        std::cout << std::fixed << std::setprecision(1)
+            << std::setw(8) << count << std::setw(8) << acl.group_count()
+            << std::setw(11) << 100.0 * matched / frames.size() << "%"
+            << std::setw(16) << compiled_ns << std::setw(14) << linear_ns << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,244 @@
+#include <sys/socket.h>
+#include <poll.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <networking/linklayer/time_utils.h>
+#include <string_utils.h>
+
+using cpp_utils::string_utils::convert_string;
+
+/**
+ * Forwarding latency of a running forwarder, to compare its poll_mode (or
+ * rx_mode/tx_mode) settings on the same setup. Frames go out on one port's
+ * peer and are timed until they come back on another's, one at a time
+ * every interval_us, so each one finds the forwarder idle the way sparse
+ * traffic does. With stream set they go out every interval_us without
+ * waiting for each other, so frames meet in the forwarder's batches and
+ * output buffers the way steady traffic does. Prints the latency
+ * percentiles and, given the forwarder's pid, the cpu it used meanwhile.
+ * Its stats line (stats_interval) has the syscalls per frame to go with
+ * them.
+ *
+ * The bench sleeps in poll() like any receiver would, its wakeup is part
+ * of every mode's numbers alike. Needs root, e.g. with the peers of veth
+ * pairs whose other ends are forwarder ports.
+ */
+
+constexpr uint16_t ETHERTYPE = 0x88b5; // local experimental
+constexpr uint64_t TIMEOUT_NS = 100'000'000;
+const unsigned char TX_MAC[6] = {0x02, 0x00, 0x00, 0x00, 0xbe, 0x01};
+const unsigned char RX_MAC[6] = {0x02, 0x00, 0x00, 0x00, 0xbe, 0x02};
+const unsigned char BROADCAST[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+int open_socket(const std::string& ifname) {
+    int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+        perror("socket");
+        exit(1);
+    }
+    sockaddr_ll addr{};
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = if_nametoindex(ifname.c_str());
+    if (addr.sll_ifindex == 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        perror(ifname.c_str());
+        exit(1);
+    }
+    int ignore = 1;
+    setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &ignore, sizeof(ignore));
+    return fd;
+}
+
+void send_frame(int fd, const unsigned char* dst, const unsigned char* src, uint64_t seq) {
+    unsigned char frame[60]{};
+    memcpy(frame, dst, 6);
+    memcpy(frame + 6, src, 6);
+    frame[12] = ETHERTYPE >> 8;
+    frame[13] = ETHERTYPE & 0xFF;
+    memcpy(frame + 14, &seq, sizeof(seq));
+    if (send(fd, frame, sizeof(frame), 0) < 0) {
+        perror("send");
+    }
+}
+
+/**
+ * @brief waits until frame seq arrives on fd, false after TIMEOUT_NS
+ */
+bool wait_frame(int fd, uint64_t seq, uint64_t start_ns) {
+    unsigned char frame[2048];
+    pollfd pfd{fd, POLLIN, 0};
+    while (now_ns_monotonic() - start_ns < TIMEOUT_NS) {
+        int r = recv(fd, frame, sizeof(frame), MSG_DONTWAIT);
+        if (r < 0) {
+            poll(&pfd, 1, 1 + (TIMEOUT_NS - (now_ns_monotonic() - start_ns)) / 1'000'000);
+            continue;
+        }
+        if (r < 22 || frame[12] != ETHERTYPE >> 8 || frame[13] != (ETHERTYPE & 0xFF)) {
+            continue;
+        }
+        uint64_t received;
+        memcpy(&received, frame + 14, sizeof(received));
+        if (received == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief
+ * Stamps the arrival of every frame of a stream by its sequence number
+ * until all arrived or TIMEOUT_NS passed since the last one went out
+ *
+ * @param fd
+ * @param received_ns arrival times, 0 for frames not seen
+ * @param sent_all_ns when the last frame went out, 0 until then
+ */
+void receive_stream(int fd, std::vector<uint64_t>& received_ns, std::atomic<uint64_t>& sent_all_ns) {
+    unsigned char frame[2048];
+    pollfd pfd{fd, POLLIN, 0};
+    size_t arrived = 0;
+    while (arrived < received_ns.size()) {
+        uint64_t done_ns = sent_all_ns.load();
+        if (done_ns != 0 && now_ns_monotonic() - done_ns >= TIMEOUT_NS) {
+            return;
+        }
+        int r = recv(fd, frame, sizeof(frame), MSG_DONTWAIT);
+        if (r < 0) {
+            poll(&pfd, 1, 1);
+            continue;
+        }
+        if (r < 22 || frame[12] != ETHERTYPE >> 8 || frame[13] != (ETHERTYPE & 0xFF)) {
+            continue;
+        }
+        uint64_t seq;
+        memcpy(&seq, frame + 14, sizeof(seq));
+        if (seq < received_ns.size() && received_ns[seq] == 0) {
+            received_ns[seq] = now_ns_monotonic();
+            arrived++;
+        }
+    }
+}
+
+/**
+ * @brief user and system cpu time of pid in clock ticks, 0 if unknown
+ */
+uint64_t process_ticks(int pid) {
+    std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    size_t end = stat.rfind(')');
+    if (end == std::string::npos) {
+        return 0;
+    }
+    // fields after the command name, starting with the state (field 3)
+    std::istringstream fields(stat.substr(end + 2));
+    std::string field;
+    uint64_t ticks = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+        if (i >= 14) {
+            ticks += convert_string<uint64_t>(field);
+        }
+    }
+    return ticks;
+}
+
+double percentile(const std::vector<uint64_t>& sorted, double p) {
+    return sorted[std::min<size_t>(sorted.size() - 1, sorted.size() * p)] / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: ./forward_latency_bench <tx ifname> <rx ifname> [frames] [interval us] [forwarder pid] [stream]" << std::endl;
+        return 0;
+    }
+    std::string tx_ifname(argv[1]);
+    std::string rx_ifname(argv[2]);
+    unsigned int frames = argc > 3 ? convert_string<unsigned int>(argv[3]) : 10000;
+    unsigned int interval_us = argc > 4 ? convert_string<unsigned int>(argv[4]) : 200;
+    int pid = argc > 5 ? convert_string<int>(argv[5]) : 0;
+    bool stream = argc > 6 && convert_string<int>(argv[6]) != 0;
+
+    int tx_fd = open_socket(tx_ifname);
+    int rx_fd = open_socket(rx_ifname);
+
+    std::vector<uint64_t> latencies;
+    latencies.reserve(frames);
+    unsigned int lost = 0;
+
+    std::vector<uint64_t> sent_ns(frames);
+    std::vector<uint64_t> received_ns(frames);
+    std::atomic<uint64_t> sent_all_ns{0};
+    std::thread receiver;
+
+    uint64_t start_ns = now_ns_monotonic();
+    uint64_t start_ticks = pid ? process_ticks(pid) : 0;
+
+    uint64_t next_ns = start_ns;
+    for (unsigned int i = 0; i < frames; i++) {
+        if (i % 1000 == 0) {
+            // (re)teach the forwarder where RX_MAC is, well within the aging timeout
+            send_frame(rx_fd, BROADCAST, RX_MAC, ~(uint64_t)0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            next_ns = now_ns_monotonic();
+            if (stream && i == 0) {
+                receiver = std::thread(receive_stream, rx_fd, std::ref(received_ns), std::ref(sent_all_ns));
+            }
+        }
+
+        std::this_thread::sleep_until(std::chrono::steady_clock::time_point(std::chrono::nanoseconds(next_ns)));
+        sent_ns[i] = now_ns_monotonic();
+        send_frame(tx_fd, RX_MAC, TX_MAC, i);
+        if (!stream) {
+            received_ns[i] = wait_frame(rx_fd, i, sent_ns[i]) ? now_ns_monotonic() : 0;
+        }
+        // a stream keeps its pace, a late frame does not push the next one closer
+        next_ns = (stream ? next_ns : sent_ns[i]) + interval_us * 1000ull;
+    }
+
+    if (stream) {
+        sent_all_ns.store(now_ns_monotonic());
+        receiver.join();
+    }
+    for (unsigned int i = 0; i < frames; i++) {
+        if (received_ns[i] != 0) {
+            latencies.push_back(received_ns[i] - sent_ns[i]);
+        }
+        else {
+            lost++;
+        }
+    }
+
+    double seconds = (now_ns_monotonic() - start_ns) / 1e9;
+    uint64_t ticks = pid ? process_ticks(pid) - start_ticks : 0;
+
+    std::cout << "frames " << frames << " lost " << lost << " in " << std::fixed << std::setprecision(2) << seconds << " s" << std::endl;
+    if (!latencies.empty()) {
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << std::setprecision(1) << "latency us"
+            << " p50 " << percentile(latencies, 0.5)
+            << " p90 " << percentile(latencies, 0.9)
+            << " p99 " << percentile(latencies, 0.99)
+            << " max " << latencies.back() / 1000.0 << std::endl;
+    }
+    if (pid) {
+        std::cout << std::setprecision(1) << "forwarder cpu " << 100.0 * ticks / sysconf(_SC_CLK_TCK) / seconds << "%" << std::endl;
+    }
+
+    close(tx_fd);
+    close(rx_fd);
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+#include <networking/linklayer/HeaderClassifier.h>
+#include <networking/linklayer/PacketSwitch.h>
+#include <networking/linklayer/time_utils.h>
+#include <string_utils.h>
+
+using cpp_utils::string_utils::convert_string;
+
+/**
+ * Per frame cost of parsing ethernet headers into FrameKeys, byte by byte
+ * the way pack_mac_bytes() used to against every classify_headers_*()
+ * version this cpu runs, all of which have to produce the same keys. Then
+ * the cost of switching batches of frames out of a mac table much larger
+ * than the cache, one switchPacket() per frame against classifying and
+ * prefetching the batch before switching it.
+ */
+
+constexpr unsigned int BATCH = 32;
+
+void classify_headers_bytewise(const unsigned char* const* frames, unsigned int count, FrameKeys* keys) {
+    for (unsigned int i = 0; i < count; i++) {
+        uint64_t dst = 0;
+        uint64_t src = 0;
+        for (int b = 0; b < 6; b++) {
+            dst |= static_cast<uint64_t>(frames[i][b]) << (40 - 8*b);
+            src |= static_cast<uint64_t>(frames[i][6 + b]) << (40 - 8*b);
+        }
+        keys[i].dst_mac = dst;
+        keys[i].src_mac = src;
+        keys[i].ethertype = frames[i][12] << 8 | frames[i][13];
+    }
+}
+
+struct Classifier {
+    const char* name;
+    HeaderClassifierFn fn;
+};
+
+std::vector<Classifier> classifiers() {
+    std::vector<Classifier> found{{"bytewise", classify_headers_bytewise}, {"scalar", classify_headers_scalar}};
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3")) {
+        found.push_back({"ssse3", classify_headers_ssse3});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        found.push_back({"avx2", classify_headers_avx2});
+    }
+#elif defined(__ARM_NEON)
+    found.push_back({"neon", classify_headers_neon});
+#endif
+    return found;
+}
+
+bool same_keys(const FrameKeys& a, const FrameKeys& b) {
+    return a.dst_mac == b.dst_mac && a.src_mac == b.src_mac && a.ethertype == b.ethertype;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 3) {
+        std::cerr << "Usage: ./header_classifier_bench [macs] [passes]" << std::endl;
+        return 0;
+    }
+
+    unsigned int mac_count = argc > 1 ? convert_string<unsigned int>(argv[1]) : 1 << 20;
+    unsigned int passes = argc > 2 ? convert_string<unsigned int>(argv[2]) : 20;
+
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> macs;
+    for (unsigned int i = 0; i < mac_count; i++) {
+        macs.push_back((rng() & 0x0000FEFFFFFFFFFFULL) | 0x020000000000ULL);
+    }
+
+    // frames scattered through a buffer the way they sit in pool buffers or a ring
+    constexpr unsigned int FRAMES = 1 << 16;
+    constexpr unsigned int STRIDE = 128;
+    std::vector<unsigned char> buffer(FRAMES * STRIDE);
+    std::vector<const unsigned char*> frames(FRAMES);
+    std::vector<uint16_t> in_ports(FRAMES); // where the source was learned, so switching moves nothing
+    std::vector<unsigned int> order(FRAMES);
+    for (unsigned int i = 0; i < FRAMES; i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+    for (unsigned int i = 0; i < FRAMES; i++) {
+        unsigned char* frame = &buffer[(size_t)order[i] * STRIDE];
+        unsigned int source = rng() % macs.size();
+        std::vector<unsigned char> dst = unpack_mac_bytes(macs[rng() % macs.size()]);
+        std::vector<unsigned char> src = unpack_mac_bytes(macs[source]);
+        in_ports[i] = source % 8;
+        std::copy(dst.begin(), dst.end(), frame);
+        std::copy(src.begin(), src.end(), frame + 6);
+        frame[12] = rng() % 2 ? 0x08 : 0x86;
+        frame[13] = rng() % 2 ? 0x00 : 0xDD;
+        frames[i] = frame;
+    }
+
+    const char* best;
+    best_header_classifier(&best);
+    std::cout << "classify_headers() uses " << best << std::endl << std::endl;
+
+    std::vector<FrameKeys> expected(FRAMES);
+    classify_headers_bytewise(frames.data(), FRAMES, expected.data());
+
+    std::cout << std::setw(10) << "version" << std::setw(14) << "ns/frame" << std::endl;
+    std::vector<FrameKeys> keys(FRAMES);
+    for (const Classifier& classifier: classifiers()) {
+        // odd counts too, so the avx2 tail is checked
+        for (unsigned int count: {1u, 3u, BATCH - 1, BATCH}) {
+            for (unsigned int i = 0; i + count <= FRAMES; i += count) {
+                classifier.fn(&frames[i], count, &keys[i]);
+            }
+            for (unsigned int i = 0; i < FRAMES / count * count; i++) {
+                if (!same_keys(keys[i], expected[i])) {
+                    std::cerr << classifier.name << " differs from bytewise at frame " << i << std::endl;
+                    return 1;
+                }
+            }
+        }
+
+        uint64_t check = 0;
+        uint64_t start_ns = now_ns_monotonic();
+        for (unsigned int pass = 0; pass < passes; pass++) {
+            for (unsigned int i = 0; i < FRAMES; i += BATCH) {
+                classifier.fn(&frames[i], BATCH, &keys[i]);
+            }
+            check += keys[pass % FRAMES].dst_mac;
+        }
+        double ns = (double)(now_ns_monotonic() - start_ns) / passes / FRAMES;
+        std::cout << std::fixed << std::setprecision(2) << std::setw(10) << classifier.name << std::setw(14) << ns
+            << (check == 0 ? " (no keys)" : "") << std::endl;
+    }
+
+    PacketSwitch packetSwitch(mac_count * 2, (uint64_t)3600 * 1'000'000'000);
+    uint64_t now_ns = now_ns_monotonic();
+    for (unsigned int i = 0; i < macs.size(); i++) {
+        unsigned char frame[16] = {0};
+        std::vector<unsigned char> src = unpack_mac_bytes(macs[i]);
+        std::copy(src.begin(), src.end(), frame + 6);
+        frame[0] = 0xFF; // broadcast dst, only teaches the source
+        packetSwitch.switchPacket(i % 8, frame, sizeof(frame), now_ns);
+    }
+
+    std::cout << std::endl << std::setw(10) << "switching" << std::setw(14) << "ns/frame" << std::endl;
+    for (bool batched: {false, true}) {
+        uint64_t unicast = 0;
+        uint64_t start_ns = now_ns_monotonic();
+        for (unsigned int pass = 0; pass < passes; pass++) {
+            for (unsigned int i = 0; i < FRAMES; i += BATCH) {
+                if (batched) {
+                    FrameKeys batch_keys[BATCH];
+                    classify_headers(&frames[i], BATCH, batch_keys);
+                    packetSwitch.prefetch(nullptr, 0, &frames[i], batch_keys, BATCH);
+                    for (unsigned int j = 0; j < BATCH; j++) {
+                        unicast += packetSwitch.switchKeys(in_ports[i + j], batch_keys[j], now_ns) >= 0;
+                    }
+                }
+                else {
+                    for (unsigned int j = 0; j < BATCH; j++) {
+                        unicast += packetSwitch.switchPacket(in_ports[i + j], frames[i + j], 64, now_ns) >= 0;
+                    }
+                }
+            }
+        }
+        double ns = (double)(now_ns_monotonic() - start_ns) / passes / FRAMES;
+        std::cout << std::fixed << std::setprecision(2) << std::setw(10) << (batched ? "batch" : "frame") << std::setw(14) << ns
+            << std::setw(10) << 100.0 * unicast / passes / FRAMES << "% unicast" << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include <networking/linklayer/MacTable.h>
+#include <string_utils.h>
+
+using cpp_utils::string_utils::convert_string;
+
+/**
+ * Lookup throughput of MacTable with 1-4 reader threads, with and without a
+ * learner thread moving macs between ports and flushing a port. "rwlock"
+ * wraps the same table in a std::shared_mutex the way the forwarder did
+ * before lookups went lock free.
+ */
+
+struct Result {
+    double lookups_per_sec;
+    double learns_per_sec;
+};
+
+Result run(MacTable& table, std::vector<uint64_t>& macs, unsigned int readers, bool learner, bool rwlock, double seconds) {
+    std::shared_mutex lock;
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> lookups{0};
+    std::atomic<uint64_t> learns{0};
+    std::vector<std::thread> threads;
+
+    for (unsigned int r = 0; r < readers; r++) {
+        threads.emplace_back([&, r]() {
+            std::mt19937_64 rng(r + 1);
+            uint64_t count = 0;
+            uint64_t hits = 0;
+            uint64_t now_ns = now_ns_monotonic();
+            while (!stop.load(std::memory_order_relaxed)) {
+                for (int i = 0; i < 1024; i++) {
+                    uint64_t mac = macs[rng() % macs.size()];
+                    if (rwlock) {
+                        lock.lock_shared();
+                    }
+                    hits += table.lookup(mac, now_ns) != MacTable::NO_PORT;
+                    if (rwlock) {
+                        lock.unlock_shared();
+                    }
+                }
+                count += 1024;
+            }
+            lookups += count;
+            if (hits == 0) {
+                std::cerr << "reader " << r << " found nothing" << std::endl;
+            }
+        });
+    }
+
+    if (learner) {
+        threads.emplace_back([&]() {
+            std::mt19937_64 rng(0);
+            uint64_t count = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                uint64_t now_ns = now_ns_monotonic();
+                for (int i = 0; i < 1024; i++) {
+                    uint64_t mac = macs[rng() % macs.size()];
+                    if (rwlock) {
+                        lock.lock();
+                    }
+                    table.addEntry(rng() % 8, mac, now_ns);
+                    if (rwlock) {
+                        lock.unlock();
+                    }
+                }
+                count += 1024;
+
+                // exercise backward shift deletion, the macs come back on the next pass
+                if (rwlock) {
+                    lock.lock();
+                }
+                table.removePort(rng() % 8);
+                if (rwlock) {
+                    lock.unlock();
+                }
+            }
+            learns += count;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& thread: threads) {
+        thread.join();
+    }
+
+    return Result{lookups / seconds, learns / seconds};
+}
+
+int main(int argc, char** argv) {
+    if (argc > 3) {
+        std::cerr << "Usage: ./mac_table_bench [macs] [seconds per run]" << std::endl;
+        return 0;
+    }
+
+    unsigned int mac_count = argc > 1 ? convert_string<unsigned int>(argv[1]) : 4096;
+    double seconds = argc > 2 ? convert_string<double>(argv[2]) : 1.0;
+
+    std::vector<uint64_t> macs;
+    std::mt19937_64 rng(42);
+    for (unsigned int i = 0; i < mac_count; i++) {
+        macs.push_back((rng() & 0x0000FEFFFFFFFFFFULL) | 0x020000000000ULL);
+    }
+
+    std::cout << std::setw(8) << "mode" << std::setw(9) << "readers" << std::setw(9) << "learner"
+        << std::setw(16) << "Mlookups/s" << std::setw(16) << "per reader" << std::setw(14) << "Mlearns/s" << std::endl;
+
+    for (bool rwlock: {false, true}) {
+        for (bool learner: {false, true}) {
+            for (unsigned int readers = 1; readers <= 4; readers++) {
+                MacTable table(mac_count * 2, (uint64_t)3600 * 1'000'000'000);
+                uint64_t now_ns = now_ns_monotonic();
+                for (unsigned int i = 0; i < macs.size(); i++) {
+                    table.addEntry(i % 8, macs[i], now_ns);
+                }
+
+                Result result = run(table, macs, readers, learner, rwlock, seconds);
+                std::cout << std::fixed << std::setprecision(2)
+                    << std::setw(8) << (rwlock ? "rwlock" : "lockfree") << std::setw(9) << readers << std::setw(9) << (learner ? "yes" : "no")
+                    << std::setw(16) << result.lookups_per_sec / 1e6
+                    << std::setw(16) << result.lookups_per_sec / 1e6 / readers
+                    << std::setw(14) << result.learns_per_sec / 1e6 << std::endl;
+            }
+        }
+    }
+
+    return 0;
+}